@@ -7,222 +7,182 @@
 #include <unordered_map>
 #include <set>
 #include <vector>
-#include <mutex>
 #include <atomic>
 #include <algorithm>
+#include <numeric>
+#include <limits>
 
 #include "helper.hpp"
 #include "types.hpp"
+#include "alignment.hpp"
+#include "thread_pool.hpp"
+#include "stats.hpp"
 #include "kir.hpp"
 
 using namespace std;
 
-void naive_align(int thread_id, unordered_map<string, unordered_map<string, string>> &kirs, const string &reads_file, unordered_map<string, unordered_map<string, vector<ReadAlignment>>> &all_alignments, mutex &mtx, unordered_map<string, unordered_map<string, string>>::iterator &gene_it, mutex &gene_it_mtx, atomic<int> &progress, int n_threads)
+/* Per-thread alignment buffers that tasks append to without locking, merged once all tasks are done
+ * Only the pool's threads and the single thread that waits on the pool may add to it */
+class AlignmentSink
 {
-    string alleles_fasta_file = "alleles_" + to_string(thread_id) + ".fa";
+public:
+    explicit AlignmentSink(ThreadPool &pool) : pool(pool), buffers(pool.size()) {}
 
-    while (true)
+    void add(AlignmentSet &&alignments)
     {
-        // get slice of [i * len(kirs) / n_threads, (i + 1) * len(kirs) / n_threads]
-        unordered_map<string, unordered_map<string, string>> thread_kirs;
-        {
-            lock_guard<mutex> lock(gene_it_mtx);
-            if (gene_it == kirs.end())
-                break;
-            for (int i = 0; i < (int)kirs.size() / n_threads; ++i)
-            {
-                if (gene_it == kirs.end())
-                    break;
-                thread_kirs[gene_it->first] = gene_it->second;
-                ++gene_it;
-            }
-        }
-
-        ofstream alleles_fasta(alleles_fasta_file);
-        for (const auto &gene : thread_kirs)
-            for (const auto &allele : gene.second)
-                alleles_fasta << ">" << gene.first << "." << allele.first << "\n"
-                              << allele.second << "\n";
-        alleles_fasta.close();
+        buffers[pool.thread_index()].append(move(alignments));
+    }
 
-        auto results = align_minimap(alleles_fasta_file, reads_file, n_threads);
+    /* All alignments, sorted by gene, allele and read so the output doesn't depend on scheduling */
+    AlignmentSet merge()
+    {
+        AlignmentSet merged;
+        for (auto &buffer : buffers)
+            merged.append(move(buffer));
+        merged.sort();
+        return merged;
+    }
 
-        {
-            lock_guard<mutex> lock(mtx);
-            for (const auto &gene_alignments : results)
-                for (const auto &allele_alignments : gene_alignments.second)
-                    all_alignments[gene_alignments.first][allele_alignments.first].insert(
-                        all_alignments[gene_alignments.first][allele_alignments.first].end(),
-                        allele_alignments.second.begin(), allele_alignments.second.end());
-        }
+private:
+    ThreadPool &pool;
+    vector<AlignmentSet> buffers;
+};
 
-        // Update progress
-        progress += thread_kirs.size();
-    }
+/* Align the given reads to one chunk of distinct alleles, and copy the hits to the identical alleles */
+void align_chunk(const IndexSequences &alleles, const AlleleClasses &classes, const ReadStore &reads, const vector<int> &read_ids, AlignmentSink &sink, ThreadPool &pool, IndexStore &indexes)
+{
+    // The allele chunks of a gene are the same on every run, so their indexes can be reused from the cache
+    sink.add(classes.expand(align_minimap(alleles, reads, read_ids, pool, 5, &indexes)));
+}
 
-    // Cleanup intermediate files
-    cleanup(alleles_fasta_file);
+/* Align all reads to every allele of a gene, one task per chunk of alleles */
+void naive_align(const unordered_map<string, unordered_map<string, string>> &kirs, const AlleleDict &dict, const ReadStore &reads, const vector<int> &read_ids, const string &gene_name, AlignmentSink &sink, ThreadPool &pool, IndexStore &indexes)
+{
+    AlleleClasses classes(gene_sequences(dict, gene_name, kirs.at(gene_name)));
+    TaskGroup chunks;
+    for (auto &alleles : classes.chunks())
+        pool.submit(chunks, [&, alleles = move(alleles)]()
+                    { align_chunk(alleles, classes, reads, read_ids, sink, pool, indexes); });
+    pool.wait(chunks);
 }
 
-void regional_align(int thread_id, unordered_map<string, unordered_map<string, string>> &kirs, unordered_map<int, string> &reads, unordered_map<string, unordered_map<string, vector<ReadAlignment>>> &first_pass_results, unordered_map<string, unordered_map<string, vector<ReadAlignment>>> &all_alignments, mutex &mtx, unordered_map<string, unordered_map<string, vector<ReadAlignment>>>::iterator &gene_it, mutex &gene_it_mtx, atomic<int> &progress, bool inc_pair, int n_threads)
+/* Second pass of a gene: one task per region of each allele hit in the first pass, aligning the region's reads to all
+ * alleles of the gene trimmed to the region */
+void regional_align(const unordered_map<string, unordered_map<string, string>> &kirs, const AlleleDict &dict, const ReadStore &reads, const AlignmentSet &first_pass_results, pair<size_t, size_t> gene_range, AlignmentSink &sink, ThreadPool &pool, bool inc_pair)
 {
-    string reads_fasta_file = "gene_reads_" + to_string(thread_id) + ".fa";
-    string alleles_fasta_file = "alleles_" + to_string(thread_id) + ".fa";
+    const auto &first_pass = first_pass_results.records;
+    const string &gene_name = dict.gene(first_pass[gene_range.first].allele_id);
 
-    while (true)
+    IndexSequences alleles = gene_sequences(dict, gene_name, kirs.at(gene_name));
+    TaskGroup region_tasks;
+    for (size_t allele_begin = gene_range.first, allele_end; allele_begin < gene_range.second; allele_begin = allele_end)
     {
-        // Get the next gene to process
-        string gene_name;
+        for (allele_end = allele_begin + 1; allele_end < gene_range.second && first_pass[allele_end].allele_id == first_pass[allele_begin].allele_id; allele_end++)
+            ;
+        // TODO: Make this a parameter, for now
+        int region_buffer = reads.length(first_pass[allele_begin].read_id) * 100; // Assume all reads have the same length
+
+        // Sweep the hits by start, a hit joins the current region if it overlaps it (Region::operator==), so regions
+        // are the connected groups of overlapping hits. This differs from merging each hit into the first overlapping
+        // region in hit order, which is not transitive and can leave overlapping regions apart. Reads are collected in
+        // plain vectors alongside.
+        vector<size_t> hits(allele_end - allele_begin);
+        iota(hits.begin(), hits.end(), allele_begin);
+        sort(hits.begin(), hits.end(), [&](size_t a, size_t b)
+             { return make_pair(first_pass[a].query_start, first_pass[a].query_end) < make_pair(first_pass[b].query_start, first_pass[b].query_end); });
+
+        vector<pair<Region, vector<int>>> regions;
+        for (size_t i : hits)
         {
-            lock_guard<mutex> lock(gene_it_mtx);
-            if (gene_it == first_pass_results.end())
-                break;
-            gene_name = gene_it->first;
-            ++gene_it;
+            const auto &alignment = first_pass[i];
+            Region hit(alignment.query_start, alignment.query_end, region_buffer);
+            if (!regions.empty() && regions.back().first == hit)
+                regions.back().first.merge(hit);
+            else
+                regions.emplace_back(hit, vector<int>());
+
+            auto &region_reads = regions.back().second;
+            region_reads.push_back(alignment.read_id);
+            if (inc_pair && reads.contains(get_pair_id(alignment.read_id)))
+                region_reads.push_back(get_pair_id(alignment.read_id));
         }
 
-        for (const auto &allele_alignments : first_pass_results[gene_name])
+        // Regions that are too small are pooled into a single region
+        Region common_region(numeric_limits<int>::max(), 0, region_buffer);
+        vector<int> common_reads;
+        size_t n_kept = 0;
+        for (auto &region : regions)
         {
-            vector<Region> regions;
-            // TODO: Make this a parameter, for now
-            int region_buffer = reads.begin()->second.size() * 100; // Assume all reads have the same length
-
-            // Find reads that belong to this region
-            for (const auto &alignment : allele_alignments.second)
+            auto &region_reads = region.second;
+            sort(region_reads.begin(), region_reads.end());
+            region_reads.erase(unique(region_reads.begin(), region_reads.end()), region_reads.end());
+            if (region_reads.size() < 3) // TODO: Make this a parameter
             {
-                Region region(alignment.query_start, alignment.query_end, region_buffer);
-                region.add_read(alignment.read_id);
-                if (inc_pair)
-                    region.add_read(get_pair_id(alignment.read_id));
-
-                auto it = find(regions.begin(), regions.end(), region); // two overlapping regions are considered equal
-                if (it != regions.end())
-                    it->merge(region);
-                else
-                    regions.push_back(region);
-            }
-
-            // Filter out regions that are too small and add their reads to a single region
-            Region common_region(numeric_limits<int>::max(), 0, region_buffer);
-            for (auto it = regions.begin(); it != regions.end();)
-            {
-                if (it->reads.size() < 3) // TODO: Make this a parameter
-                {
-                    common_region.merge(*it);
-                    it = regions.erase(it);
-                }
-                else
-                    it++;
-            }
-            regions.push_back(common_region);
-
-            for (const auto &region : regions)
-            {
-                if (region.reads.empty())
-                    continue;
-    
-                // Extract reads that belong to this region
-                ofstream gene_reads(reads_fasta_file);
-                for (const auto &read_id : region.reads)
-                    gene_reads << ">" << read_id << "\n"
-                               << reads[read_id] << "\n";
-                gene_reads.close();
-
-                // generate a temporary allele fasta where all alleles are trimmed to the region
-                ofstream alleles_fasta(alleles_fasta_file);
-                for (const auto &allele : kirs[gene_name])
-                {
-                    string trimmed_allele = allele.second.substr(min(region.start, (int)allele.second.size() - 1), region.end - region.start);
-                    alleles_fasta << ">" << gene_name << "." << allele.first << "\n"
-                                  << trimmed_allele << "\n";
-                }
-                alleles_fasta.close();
-
-                auto second_pass_results = align_minimap(alleles_fasta_file, reads_fasta_file, n_threads);
-                if (second_pass_results.find(gene_name) == second_pass_results.end())
-                    continue;
-
-                // Merge the results with the global alignments map
-                for (auto &allele_alignments : second_pass_results[gene_name])
-                    for (auto &alignment : allele_alignments.second)
-                    {
-                        alignment.query_start += region.start;
-                        alignment.query_end = min(alignment.query_end + region.start, (int)kirs[gene_name][allele_alignments.first].size());
-                        all_alignments[gene_name][allele_alignments.first].push_back(alignment);
-                    }
+                common_region.merge(region.first);
+                common_reads.insert(common_reads.end(), region_reads.begin(), region_reads.end());
             }
+            else
+                regions[n_kept++] = move(region);
         }
+        regions.erase(regions.begin() + n_kept, regions.end());
+        sort(common_reads.begin(), common_reads.end());
+        common_reads.erase(unique(common_reads.begin(), common_reads.end()), common_reads.end());
+        regions.emplace_back(common_region, move(common_reads));
 
-        // Update progress
-        progress++;
+        for (auto &[region, region_reads] : regions)
+        {
+            if (region_reads.empty())
+                continue;
+
+            pool.submit(region_tasks, [&, region = region, region_reads = move(region_reads)]()
+                        {
+                            StageTimer timer("second_pass.region", gene_name + ":" + to_string(region.start) + "-" + to_string(region.end), false);
+
+                            // index all alleles trimmed to the region, alleles that are identical there are indexed once
+                            // (regions depend on the reads, so these indexes are not worth caching)
+                            IndexSequences trimmed_alleles;
+                            for (size_t i = 0; i < alleles.size(); i++)
+                                trimmed_alleles.add(alleles.names[i], alleles.seqs[i].substr(min(region.start, (int)alleles.seqs[i].size() - 1), region.end - region.start), alleles.allele_ids[i]);
+                            AlleleClasses classes(trimmed_alleles);
+
+                            auto second_pass_results = classes.expand(align_minimap(classes.unique, reads, region_reads, pool));
+
+                            // Move the hits back to full-allele coordinates
+                            for (auto &alignment : second_pass_results.records)
+                            {
+                                alignment.query_start += region.start;
+                                alignment.query_end = min(alignment.query_end + region.start, (int)kirs.at(gene_name).at(dict.alleles[alignment.allele_id]).size());
+                            }
+                            sink.add(move(second_pass_results));
+                        });
+        }
     }
-
-    // Cleanup intermediate files
-    cleanup(reads_fasta_file);
-    cleanup(alleles_fasta_file);
+    pool.wait(region_tasks);
 }
 
-void categorical_align(int thread_id, unordered_map<string, unordered_map<string, string>> &kirs, unordered_map<int, string> &reads, unordered_map<string, unordered_map<string, vector<ReadAlignment>>> &first_pass_results, unordered_map<string, unordered_map<string, vector<ReadAlignment>>> &all_alignments, mutex &mtx, unordered_map<string, unordered_map<string, vector<ReadAlignment>>>::iterator &gene_it, mutex &gene_it_mtx, atomic<int> &progress, bool inc_pair, int n_threads)
+/* Second pass of a gene: align every read hit in the first pass to all alleles of the gene, one task per chunk of alleles */
+void categorical_align(const unordered_map<string, unordered_map<string, string>> &kirs, const AlleleDict &dict, const ReadStore &reads, const AlignmentSet &first_pass_results, pair<size_t, size_t> gene_range, AlignmentSink &sink, ThreadPool &pool, bool inc_pair, IndexStore &indexes)
 {
-    string reads_fasta_file = "reads_" + to_string(thread_id) + ".fa";
-    string alleles_fasta_file = "alleles_" + to_string(thread_id) + ".fa";
+    const auto &first_pass = first_pass_results.records;
+    const string &gene_name = dict.gene(first_pass[gene_range.first].allele_id);
 
-    while (true)
+    // extract the ID of the reads that aligned to this gene
+    set<int> read_id_set;
+    for (size_t i = gene_range.first; i < gene_range.second; i++)
     {
-        // Get the next gene to process
-        string gene_name;
-        {
-            lock_guard<mutex> lock(gene_it_mtx);
-            if (gene_it == first_pass_results.end())
-                break;
-            gene_name = gene_it->first;
-            ++gene_it;
-        }
-
-        // extract the ID of the reads that aligned to this gene
-        set<int> read_ids;
-        for (const auto &allele_alignments : first_pass_results[gene_name])
-        {
-            for (const auto &match : allele_alignments.second)
-            {
-                read_ids.insert(match.read_id);
-                if (inc_pair)
-                    read_ids.insert(get_pair_id(match.read_id));
-            }
-        }
-
-        ofstream gene_reads(reads_fasta_file);
-        for (const auto &id : read_ids)
-            gene_reads << ">" << id << "\n"
-                       << reads[id] << "\n";
-        gene_reads.close();
-
-        ofstream alleles_fasta(alleles_fasta_file);
-        for (const auto &allele : kirs[gene_name])
-            alleles_fasta << ">" << gene_name << "." << allele.first << "\n"
-                          << allele.second << "\n";
-        alleles_fasta.close();
-
-        auto second_pass_results = align_minimap(alleles_fasta_file, reads_fasta_file, n_threads);
-        if (second_pass_results.find(gene_name) == second_pass_results.end())
-            // No matches in the entire gene, we should ideally never reach this point, or something must have gone wrong
-            continue;
-
-        {
-            lock_guard<mutex> lock(mtx);
-            for (const auto &allele_alignments : second_pass_results[gene_name])
-                all_alignments[gene_name][allele_alignments.first].insert(
-                    all_alignments[gene_name][allele_alignments.first].end(),
-                    allele_alignments.second.begin(), allele_alignments.second.end());
-        }
-
-        // Update progress
-        progress++;
+        const auto &match = first_pass[i];
+        read_id_set.insert(match.read_id);
+        if (inc_pair && reads.contains(get_pair_id(match.read_id)))
+            read_id_set.insert(get_pair_id(match.read_id));
     }
-
-    // Cleanup intermediate files
-    cleanup(reads_fasta_file);
-    cleanup(alleles_fasta_file);
+    vector<int> read_ids(read_id_set.begin(), read_id_set.end());
+
+    AlleleClasses classes(gene_sequences(dict, gene_name, kirs.at(gene_name)));
+    TaskGroup chunks;
+    for (auto &alleles : classes.chunks())
+        pool.submit(chunks, [&, alleles = move(alleles)]()
+                    { align_chunk(alleles, classes, reads, read_ids, sink, pool, indexes); });
+    pool.wait(chunks);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,166 @@
+#ifndef ALIGNMENT_H
+#define ALIGNMENT_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <tuple>
+#include <unordered_map>
+
+#include "helper.hpp"
+#include "minimap2/minimap.h"
+
+using namespace std;
+
+/* Gene and allele names interned to integer IDs
+ * Genes and alleles are numbered in name order, so ordering by allele ID also orders by gene */
+struct AlleleDict
+{
+    vector<string> genes;                  // gene name by gene ID
+    vector<string> alleles;                // allele name by allele ID
+    vector<int> allele_gene;               // gene ID by allele ID
+    unordered_map<string, int> allele_ids; // allele ID by `<gene>.<allele>`
+
+    AlleleDict() {}
+
+    explicit AlleleDict(const unordered_map<string, unordered_map<string, string>> &kirs)
+    {
+        for (const auto &gene : kirs)
+            genes.push_back(gene.first);
+        sort(genes.begin(), genes.end());
+        for (int gene_id = 0; gene_id < (int)genes.size(); gene_id++)
+        {
+            vector<string> gene_alleles;
+            for (const auto &allele : kirs.at(genes[gene_id]))
+                gene_alleles.push_back(allele.first);
+            sort(gene_alleles.begin(), gene_alleles.end());
+            for (const auto &allele : gene_alleles)
+            {
+                allele_ids[genes[gene_id] + "." + allele] = alleles.size();
+                alleles.push_back(allele);
+                allele_gene.push_back(gene_id);
+            }
+        }
+    }
+
+    int allele_id(const string &gene, const string &allele) const
+    {
+        return allele_ids.at(gene + "." + allele);
+    }
+
+    const string &gene(int allele_id) const { return genes[allele_gene[allele_id]]; }
+
+    string name(int allele_id) const { return gene(allele_id) + "." + alleles[allele_id]; }
+};
+
+/* A hit of a read on an allele; the CIGAR is stored as minimap2 ops in the cigars of the owning AlignmentSet */
+struct AlignmentRecord
+{
+    int32_t read_id;
+    int32_t allele_id;
+    int32_t cost;
+    int32_t read_start;  // on the read
+    int32_t read_end;
+    int32_t query_start; // on the allele
+    int32_t query_end;
+    uint32_t cigar_offset;
+    uint16_t n_cigar;
+    bool reversed;
+};
+
+/* Longest fragment of a proper pair, minimap2's default for short reads */
+const int MAX_FRAGMENT_LENGTH = 800;
+
+/* Whether two hits of the mates of a pair on the same allele face each other within MAX_FRAGMENT_LENGTH */
+bool is_proper_pair(const AlignmentRecord &a, const AlignmentRecord &b)
+{
+    if (a.allele_id != b.allele_id || a.reversed == b.reversed)
+        return false;
+    const AlignmentRecord &forward = a.reversed ? b : a, &reverse = a.reversed ? a : b;
+    return forward.query_start <= reverse.query_end && max(a.query_end, b.query_end) - min(a.query_start, b.query_start) <= MAX_FRAGMENT_LENGTH;
+}
+
+/* Flat list of alignment records with their CIGARs packed in a shared arena */
+struct AlignmentSet
+{
+    vector<AlignmentRecord> records;
+    vector<uint32_t> cigars; // minimap2 CIGAR ops, length << 4 | op
+
+    size_t size() const { return records.size(); }
+
+    bool empty() const { return records.empty(); }
+
+    void add(AlignmentRecord record, const uint32_t *cigar, uint32_t n_cigar)
+    {
+        expect(cigars.size() + n_cigar <= UINT32_MAX && n_cigar <= UINT16_MAX, "CIGAR arena is full");
+        record.cigar_offset = cigars.size();
+        record.n_cigar = n_cigar;
+        cigars.insert(cigars.end(), cigar, cigar + n_cigar);
+        records.push_back(record);
+    }
+
+    /* Add a record from another set, along with its CIGAR */
+    void add(const AlignmentRecord &record, const AlignmentSet &other)
+    {
+        add(record, other.cigars.data() + record.cigar_offset, record.n_cigar);
+    }
+
+    /* Move all records of another set to the end of this one */
+    void append(AlignmentSet &&other)
+    {
+        if (records.empty())
+        {
+            *this = move(other);
+            return;
+        }
+        expect(cigars.size() + other.cigars.size() <= UINT32_MAX, "CIGAR arena is full");
+        uint32_t offset = cigars.size();
+        cigars.insert(cigars.end(), other.cigars.begin(), other.cigars.end());
+        for (auto &record : other.records)
+        {
+            record.cigar_offset += offset;
+            records.push_back(record);
+        }
+        other = AlignmentSet();
+    }
+
+    /* Sort by allele, then read, which also groups the records by gene
+     * Hits equal in every field are ordered by their CIGAR ops, so the order never depends on the threads that found them */
+    void sort()
+    {
+        std::sort(records.begin(), records.end(), [this](const AlignmentRecord &a, const AlignmentRecord &b)
+                  {
+                      auto key_a = tie(a.allele_id, a.read_id, a.read_start, a.read_end, a.query_start, a.query_end, a.reversed, a.cost);
+                      auto key_b = tie(b.allele_id, b.read_id, b.read_start, b.read_end, b.query_start, b.query_end, b.reversed, b.cost);
+                      if (key_a != key_b)
+                          return key_a < key_b;
+                      const uint32_t *cigar_a = cigars.data() + a.cigar_offset, *cigar_b = cigars.data() + b.cigar_offset;
+                      return lexicographical_compare(cigar_a, cigar_a + a.n_cigar, cigar_b, cigar_b + b.n_cigar);
+                  });
+    }
+
+    /* [begin, end) ranges of consecutive records that share a gene, the set must be sorted */
+    vector<pair<size_t, size_t>> gene_ranges(const AlleleDict &dict) const
+    {
+        vector<pair<size_t, size_t>> ranges;
+        for (size_t begin = 0, end; begin < records.size(); begin = end)
+        {
+            int gene_id = dict.allele_gene[records[begin].allele_id];
+            for (end = begin + 1; end < records.size() && dict.allele_gene[records[end].allele_id] == gene_id; end++)
+                ;
+            ranges.push_back({begin, end});
+        }
+        return ranges;
+    }
+
+    string cigar(const AlignmentRecord &record) const
+    {
+        string cigar;
+        for (uint32_t k = record.cigar_offset; k < record.cigar_offset + record.n_cigar; k++)
+            cigar += to_string(cigars[k] >> 4) + MM_CIGAR_STR[cigars[k] & 0xf];
+        return cigar;
+    }
+};
+
+#endif
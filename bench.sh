@@ -0,0 +1,57 @@
+#!/bin/sh
+# Times the alignment methods on simulated reads and scores them against the simulated truth
+# Settings come from the environment, see the bench target of the Makefile
+set -e
+
+DATABASE=${DATABASE:-kirdb.fa.gz}
+BENCH_DIR=${BENCH_DIR:-bench_out}
+BENCH_DEPTH=${BENCH_DEPTH:-30}
+BENCH_LENGTH=${BENCH_LENGTH:-150}
+BENCH_ERROR=${BENCH_ERROR:-0.001}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_METHODS=${BENCH_METHODS:-"naive regional categorical"}
+BENCH_THREADS=${BENCH_THREADS:-"1 $(nproc)"}
+BENCH_REPS=${BENCH_REPS:-"1 3"}
+BENCH_INPUTS=${BENCH_INPUTS:-"single paired"}
+
+mkdir -p "$BENCH_DIR"
+./simulate reads "$DATABASE" "$BENCH_DIR/reads.fa" "$BENCH_DIR/truth.tsv" \
+    --depth "$BENCH_DEPTH" --length "$BENCH_LENGTH" --error "$BENCH_ERROR" --seed "$BENCH_SEED"
+n_reads=$(wc -l < "$BENCH_DIR/truth.tsv")
+# The simulated mates alternate, split them into R1 and R2 files for the paired runs
+awk 'NR % 4 == 1 || NR % 4 == 2' "$BENCH_DIR/reads.fa" > "$BENCH_DIR/reads_1.fa"
+awk 'NR % 4 == 3 || NR % 4 == 0' "$BENCH_DIR/reads.fa" > "$BENCH_DIR/reads_2.fa"
+first_reps=${BENCH_REPS%% *}
+
+printf "input\tmethod\tthreads\treps\twall_s\tcpu_s\treads_per_s\trecall\tprecision\n"
+# Single runs map the reads one by one, paired runs give the mates as R1 and R2 files, mapped as fragments. Reads are
+# numbered the same way in both, so both score against the same truth.
+for input in $BENCH_INPUTS; do
+    if [ "$input" = paired ]; then
+        reads="$BENCH_DIR/reads_1.fa $BENCH_DIR/reads_2.fa"
+    else
+        reads="$BENCH_DIR/reads.fa"
+    fi
+    for method in $BENCH_METHODS; do
+        for threads in $BENCH_THREADS; do
+            for reps in $BENCH_REPS; do
+                # -r does not apply to the naive method
+                if [ "$method" = naive ] && [ "$reps" != "$first_reps" ]; then
+                    continue
+                fi
+                run="$BENCH_DIR/$input.$method.t$threads.r$reps"
+                ./main align "$DATABASE" $reads --method "$method" -t "$threads" -r "$reps" \
+                    -o "$run.tsv" --stats "$run.json" > "$run.log"
+                scores=$(./simulate evaluate "$BENCH_DIR/truth.tsv" "$run.tsv")
+                awk -v input="$input" -v method="$method" -v threads="$threads" -v reps="$reps" -v n_reads="$n_reads" -v scores="$scores" '
+                    /^  "wall_s"/ { gsub(/,/, "", $2); wall = $2 }
+                    /^  "cpu_s"/ { gsub(/,/, "", $2); cpu = $2 }
+                    END {
+                        split(scores, lines, "\n")
+                        for (i in lines) { split(lines[i], field, "\t"); score[field[1]] = field[2] }
+                        printf "%s\t%s\t%s\t%s\t%.2f\t%.2f\t%.0f\t%s\t%s\n", input, method, threads, reps, wall, cpu, n_reads / wall, score["recall"], score["precision"]
+                    }' "$run.json"
+            done
+        done
+    done
+done
@@ -0,0 +1,330 @@
+#ifndef BINARY_FORMAT_H
+#define BINARY_FORMAT_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+
+#include "helper.hpp"
+#include "alignment.hpp"
+
+using namespace std;
+
+/* Binary alignment file
+ *
+ * The file starts with the gene and allele dictionary, followed by blocks of up to BLOCK_RECORDS records in the
+ * order they were written (by gene, allele and read). Each block stores its records column by column and is
+ * deflated. A sidecar `<file>.idx` holds the file offset and allele range of each block, and (read ID, block)
+ * pairs sorted by read ID, so queries by read, gene or allele only read the blocks they need. */
+
+const char BINARY_MAGIC[8] = {'K', 'I', 'R', 'A', 'L', 'A', 'B', '1'};
+const char BINARY_INDEX_MAGIC[8] = {'K', 'I', 'R', 'A', 'L', 'A', 'I', '1'};
+
+struct BinaryBlockInfo
+{
+    uint64_t offset;
+    uint32_t n_records;
+    int32_t min_allele;
+    int32_t max_allele;
+};
+
+struct BinaryReadEntry
+{
+    int32_t read_id;
+    uint32_t block;
+
+    bool operator<(const BinaryReadEntry &other) const
+    {
+        return read_id < other.read_id || (read_id == other.read_id && block < other.block);
+    }
+
+    bool operator==(const BinaryReadEntry &other) const { return read_id == other.read_id && block == other.block; }
+};
+
+class BinaryAlignmentWriter
+{
+public:
+    static const uint32_t BLOCK_RECORDS = 1 << 16;
+
+    size_t bytes_written = 0;
+
+    BinaryAlignmentWriter(FILE *out_file, const string &index_file, const AlleleDict &dict) : out_file(out_file), index_file(index_file)
+    {
+        write_raw(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        write_value<uint32_t>(dict.genes.size());
+        for (const auto &gene : dict.genes)
+            write_string(gene);
+        write_value<uint32_t>(dict.alleles.size());
+        for (size_t allele_id = 0; allele_id < dict.alleles.size(); allele_id++)
+        {
+            write_value<uint32_t>(dict.allele_gene[allele_id]);
+            write_string(dict.alleles[allele_id]);
+        }
+    }
+
+    /* Append alignments, which must come in (allele, read) order across calls */
+    void write(const AlignmentSet &alignments)
+    {
+        for (const auto &record : alignments.records)
+        {
+            block.add(record, alignments);
+            if (block.size() == BLOCK_RECORDS)
+                flush_block();
+        }
+    }
+
+    /* Write the last block and the sidecar index */
+    void finish()
+    {
+        if (!block.empty())
+            flush_block();
+
+        sort(read_entries.begin(), read_entries.end());
+        read_entries.erase(unique(read_entries.begin(), read_entries.end()), read_entries.end());
+
+        FILE *index = expect(fopen(index_file.c_str(), "wb"), "[-] Error: Unable to open file " + index_file + " for writing.");
+        uint64_t n_blocks = blocks.size(), n_entries = read_entries.size();
+        expect(fwrite(BINARY_INDEX_MAGIC, sizeof(BINARY_INDEX_MAGIC), 1, index) == 1 &&
+                   fwrite(&n_blocks, sizeof(n_blocks), 1, index) == 1 &&
+                   fwrite(&n_entries, sizeof(n_entries), 1, index) == 1 &&
+                   fwrite(blocks.data(), sizeof(BinaryBlockInfo), n_blocks, index) == n_blocks &&
+                   fwrite(read_entries.data(), sizeof(BinaryReadEntry), n_entries, index) == n_entries,
+               "[-] Error: Failed to write " + index_file);
+        fclose(index);
+    }
+
+private:
+    FILE *out_file;
+    string index_file;
+    AlignmentSet block;
+    vector<BinaryBlockInfo> blocks;
+    vector<BinaryReadEntry> read_entries;
+
+    void write_raw(const void *data, size_t size)
+    {
+        expect(fwrite(data, 1, size, out_file) == size, "[-] Error: Failed to write alignments.");
+        bytes_written += size;
+    }
+
+    template <typename T>
+    void write_value(T value) { write_raw(&value, sizeof(value)); }
+
+    void write_string(const string &value)
+    {
+        write_value<uint32_t>(value.size());
+        write_raw(value.data(), value.size());
+    }
+
+    template <typename T, typename F>
+    static void append_column(string &columns, const vector<AlignmentRecord> &records, F field)
+    {
+        for (const auto &record : records)
+        {
+            T value = field(record);
+            columns.append((const char *)&value, sizeof(value));
+        }
+    }
+
+    void flush_block()
+    {
+        const auto &records = block.records;
+        string columns;
+        append_column<int32_t>(columns, records, [](const AlignmentRecord &r) { return r.read_id; });
+        append_column<int32_t>(columns, records, [](const AlignmentRecord &r) { return r.allele_id; });
+        append_column<int32_t>(columns, records, [](const AlignmentRecord &r) { return r.cost; });
+        append_column<int32_t>(columns, records, [](const AlignmentRecord &r) { return r.read_start; });
+        append_column<int32_t>(columns, records, [](const AlignmentRecord &r) { return r.read_end; });
+        append_column<int32_t>(columns, records, [](const AlignmentRecord &r) { return r.query_start; });
+        append_column<int32_t>(columns, records, [](const AlignmentRecord &r) { return r.query_end; });
+        append_column<uint16_t>(columns, records, [](const AlignmentRecord &r) { return r.n_cigar; });
+        append_column<uint8_t>(columns, records, [](const AlignmentRecord &r) { return r.reversed; });
+        for (const auto &record : records) // the CIGARs of a block are contiguous in its arena, in record order
+            columns.append((const char *)(block.cigars.data() + record.cigar_offset), record.n_cigar * sizeof(uint32_t));
+
+        uLongf compressed_size = compressBound(columns.size());
+        string compressed(compressed_size, '\0');
+        expect(compress2((Bytef *)&compressed[0], &compressed_size, (const Bytef *)columns.data(), columns.size(), 1) == Z_OK, "Failed to compress alignments");
+
+        uint32_t n_block = blocks.size();
+        int32_t min_allele = records.front().allele_id, max_allele = records.front().allele_id;
+        for (const auto &record : records)
+        {
+            min_allele = min(min_allele, record.allele_id);
+            max_allele = max(max_allele, record.allele_id);
+            read_entries.push_back({record.read_id, n_block});
+        }
+        blocks.push_back({bytes_written, (uint32_t)records.size(), min_allele, max_allele});
+
+        write_value<uint32_t>(records.size());
+        write_value<uint32_t>(columns.size());
+        write_value<uint32_t>(compressed_size);
+        write_raw(compressed.data(), compressed_size);
+        block = AlignmentSet();
+    }
+};
+
+class BinaryAlignmentReader
+{
+public:
+    AlleleDict dict;
+    vector<BinaryBlockInfo> blocks;
+
+    static bool is_binary(const string &alignments_file)
+    {
+        char magic[sizeof(BINARY_MAGIC)] = {};
+        FILE *file = fopen(alignments_file.c_str(), "rb");
+        if (!file)
+            return false;
+        bool binary = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0;
+        fclose(file);
+        return binary;
+    }
+
+    explicit BinaryAlignmentReader(const string &alignments_file)
+    {
+        in_file = expect(fopen(alignments_file.c_str(), "rb"), "[x] Failed to open alignments file " + alignments_file);
+        char magic[sizeof(BINARY_MAGIC)];
+        read_raw(in_file, magic, sizeof(magic));
+        expect(memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0, "[x] Not a binary alignments file: " + alignments_file);
+        dict.genes.resize(read_value<uint32_t>(in_file));
+        for (auto &gene : dict.genes)
+            gene = read_string(in_file);
+        uint32_t n_alleles = read_value<uint32_t>(in_file);
+        for (uint32_t allele_id = 0; allele_id < n_alleles; allele_id++)
+        {
+            dict.allele_gene.push_back(read_value<uint32_t>(in_file));
+            dict.alleles.push_back(read_string(in_file));
+            dict.allele_ids[dict.name(allele_id)] = allele_id;
+        }
+
+        string index_file = alignments_file + ".idx";
+        index = expect(fopen(index_file.c_str(), "rb"), "[x] Failed to open alignments index " + index_file);
+        read_raw(index, magic, sizeof(magic));
+        expect(memcmp(magic, BINARY_INDEX_MAGIC, sizeof(magic)) == 0, "[x] Not an alignments index: " + index_file);
+        uint64_t n_blocks = read_value<uint64_t>(index);
+        n_read_entries = read_value<uint64_t>(index);
+        blocks.resize(n_blocks);
+        read_raw(index, blocks.data(), n_blocks * sizeof(BinaryBlockInfo));
+        read_entries_offset = sizeof(BINARY_INDEX_MAGIC) + 2 * sizeof(uint64_t) + n_blocks * sizeof(BinaryBlockInfo);
+    }
+
+    ~BinaryAlignmentReader()
+    {
+        fclose(in_file);
+        fclose(index);
+    }
+
+    /* Blocks holding alignments of the read, found by binary search over the on-disk read index */
+    vector<uint32_t> read_blocks(int read_id)
+    {
+        uint64_t low = 0, high = n_read_entries;
+        while (low < high)
+        {
+            uint64_t mid = (low + high) / 2;
+            if (read_entry(mid).read_id < read_id)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        vector<uint32_t> found;
+        for (BinaryReadEntry entry; low < n_read_entries && (entry = read_entry(low)).read_id == read_id; low++)
+            found.push_back(entry.block);
+        return found;
+    }
+
+    /* Blocks that may hold alignments to an allele in [min_allele, max_allele] */
+    vector<uint32_t> allele_blocks(int min_allele, int max_allele)
+    {
+        vector<uint32_t> found;
+        for (uint32_t b = 0; b < blocks.size(); b++)
+            if (blocks[b].min_allele <= max_allele && blocks[b].max_allele >= min_allele)
+                found.push_back(b);
+        return found;
+    }
+
+    AlignmentSet read_block(uint32_t b)
+    {
+        expect(fseeko(in_file, blocks[b].offset, SEEK_SET) == 0, "[x] Failed to seek in alignments file");
+        uint32_t n_records = read_value<uint32_t>(in_file);
+        uLongf columns_size = read_value<uint32_t>(in_file);
+        uint32_t compressed_size = read_value<uint32_t>(in_file);
+        string compressed(compressed_size, '\0'), columns(columns_size, '\0');
+        read_raw(in_file, &compressed[0], compressed_size);
+        expect(uncompress((Bytef *)&columns[0], &columns_size, (const Bytef *)compressed.data(), compressed_size) == Z_OK, "[x] Corrupt alignments block");
+
+        AlignmentSet alignments;
+        alignments.records.resize(n_records);
+        const char *column = columns.data();
+        read_column<int32_t>(column, alignments.records, [](AlignmentRecord &r, int32_t v) { r.read_id = v; });
+        read_column<int32_t>(column, alignments.records, [](AlignmentRecord &r, int32_t v) { r.allele_id = v; });
+        read_column<int32_t>(column, alignments.records, [](AlignmentRecord &r, int32_t v) { r.cost = v; });
+        read_column<int32_t>(column, alignments.records, [](AlignmentRecord &r, int32_t v) { r.read_start = v; });
+        read_column<int32_t>(column, alignments.records, [](AlignmentRecord &r, int32_t v) { r.read_end = v; });
+        read_column<int32_t>(column, alignments.records, [](AlignmentRecord &r, int32_t v) { r.query_start = v; });
+        read_column<int32_t>(column, alignments.records, [](AlignmentRecord &r, int32_t v) { r.query_end = v; });
+        read_column<uint16_t>(column, alignments.records, [](AlignmentRecord &r, uint16_t v) { r.n_cigar = v; });
+        read_column<uint8_t>(column, alignments.records, [](AlignmentRecord &r, uint8_t v) { r.reversed = v; });
+        // The CIGAR column follows columns of odd widths, so it is copied out rather than read in place
+        size_t cigars_size = columns.data() + columns.size() - column;
+        expect(cigars_size % sizeof(uint32_t) == 0, "[x] Corrupt alignments block");
+        alignments.cigars.resize(cigars_size / sizeof(uint32_t));
+        memcpy(alignments.cigars.data(), column, cigars_size);
+        uint32_t cigar_offset = 0;
+        for (auto &record : alignments.records)
+        {
+            record.cigar_offset = cigar_offset;
+            cigar_offset += record.n_cigar;
+        }
+        return alignments;
+    }
+
+private:
+    FILE *in_file;
+    FILE *index;
+    uint64_t n_read_entries;
+    uint64_t read_entries_offset;
+
+    static void read_raw(FILE *file, void *data, size_t size)
+    {
+        expect(fread(data, 1, size, file) == size, "[x] Truncated alignments file");
+    }
+
+    template <typename T>
+    static T read_value(FILE *file)
+    {
+        T value;
+        read_raw(file, &value, sizeof(value));
+        return value;
+    }
+
+    static string read_string(FILE *file)
+    {
+        string value(read_value<uint32_t>(file), '\0');
+        read_raw(file, &value[0], value.size());
+        return value;
+    }
+
+    template <typename T, typename F>
+    static void read_column(const char *&column, vector<AlignmentRecord> &records, F set_field)
+    {
+        for (auto &record : records)
+        {
+            T value;
+            memcpy(&value, column, sizeof(value));
+            set_field(record, value);
+            column += sizeof(value);
+        }
+    }
+
+    BinaryReadEntry read_entry(uint64_t i)
+    {
+        expect(fseeko(index, read_entries_offset + i * sizeof(BinaryReadEntry), SEEK_SET) == 0, "[x] Failed to seek in alignments index");
+        return read_value<BinaryReadEntry>(index);
+    }
+};
+
+#endif
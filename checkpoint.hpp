@@ -0,0 +1,212 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "helper.hpp"
+#include "alignment.hpp"
+#include "read_store.hpp"
+#include "kir.hpp"
+
+using namespace std;
+
+/* Progress of one sample's run saved to a directory, so that an interrupted run can resume where it stopped
+ *   run          key of the run: the reads, the options and the database, a resume with another key is refused
+ *   first_pass   results of the first pass, and `first_pass.reads` the reads it kept when streaming
+ *   genes        alignments of each finished gene, appended as the genes finish
+ * Each saved set is `<gene ID> <records> <CIGAR ops> <records...> <CIGAR ops...> <checksum>`, so a gene cut short by a
+ * crash is detected and dropped on resume. The first pass is written to a temporary file and renamed once complete. */
+class Checkpoint
+{
+public:
+    Checkpoint(const string &dir, uint64_t run_key, bool resume, ostream &log) : dir(dir)
+    {
+        char key[32];
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)run_key);
+
+        string saved_key;
+        ifstream(path("run")) >> saved_key;
+        if (resume && !saved_key.empty())
+        {
+            expect(saved_key == key, "[x] The checkpoint in " + dir + " is of another run, with other reads, options or database");
+            load_genes();
+            log << "[+] Resuming with " << done.size() << " gene(s)" << (has_first_pass() ? " and the first pass" : "") << " from " << dir << "." << endl;
+        }
+        else
+        {
+            remove_files();
+            mkdir(dir.c_str(), 0755);
+            ofstream run(path("run"));
+            run << key << '\n';
+            expect(run.good(), "[x] Failed to write checkpoint in " + dir);
+        }
+        genes_out = expect(fopen(path("genes").c_str(), "ab"), "[x] Failed to open checkpoint in " + dir);
+    }
+
+    ~Checkpoint()
+    {
+        if (genes_out)
+            fclose(genes_out);
+    }
+
+    bool has_first_pass() const { return file_exists(path("first_pass")); }
+
+    /* First pass results, and the reads it kept if they were saved with it and kept_reads is still empty */
+    AlignmentSet load_first_pass(ReadStore &kept_reads)
+    {
+        if (kept_reads.size() == 0 && file_exists(path("first_pass.reads")))
+        {
+            FILE *in = expect(fopen(path("first_pass.reads").c_str(), "rb"), "[x] Failed to open checkpoint in " + dir);
+            int32_t read_id;
+            uint32_t length;
+            string seq;
+            while (fread(&read_id, sizeof(read_id), 1, in) == 1 && fread(&length, sizeof(length), 1, in) == 1)
+            {
+                seq.resize(length);
+                expect(fread(&seq[0], 1, length, in) == length, "[x] Truncated checkpoint in " + dir);
+                kept_reads.add(read_id, seq.data(), seq.size());
+            }
+            fclose(in);
+        }
+        FILE *in = expect(fopen(path("first_pass").c_str(), "rb"), "[x] Failed to open checkpoint in " + dir);
+        int gene_id;
+        AlignmentSet first_pass;
+        expect(read_set(in, gene_id, first_pass), "[x] Corrupt first pass in checkpoint " + dir);
+        fclose(in);
+        return first_pass;
+    }
+
+    /* Save the first pass results, and the reads it kept if it streamed them */
+    void save_first_pass(const AlignmentSet &first_pass, const ReadStore *kept_reads)
+    {
+        if (kept_reads)
+        {
+            FILE *out = expect(fopen(path("first_pass.reads.tmp").c_str(), "wb"), "[x] Failed to write checkpoint in " + dir);
+            string buffer;
+            for (int read_id : kept_reads->ids)
+            {
+                string_view seq = kept_reads->get(read_id, buffer);
+                uint32_t length = seq.size();
+                fwrite(&read_id, sizeof(read_id), 1, out);
+                fwrite(&length, sizeof(length), 1, out);
+                fwrite(seq.data(), 1, length, out);
+            }
+            close_synced(out);
+            expect(rename(path("first_pass.reads.tmp").c_str(), path("first_pass.reads").c_str()) == 0, "[x] Failed to write checkpoint in " + dir);
+        }
+        FILE *out = expect(fopen(path("first_pass.tmp").c_str(), "wb"), "[x] Failed to write checkpoint in " + dir);
+        write_set(out, -1, first_pass);
+        close_synced(out);
+        expect(rename(path("first_pass.tmp").c_str(), path("first_pass").c_str()) == 0, "[x] Failed to write checkpoint in " + dir);
+    }
+
+    /* Whether each gene, by gene ID, was finished before */
+    bool is_done(int gene_id) const { return binary_search(done.begin(), done.end(), gene_id); }
+
+    /* Call f(gene_id, alignments) for each gene finished before, in the order they finished */
+    void for_each_done_gene(const function<void(int, AlignmentSet &&)> &f)
+    {
+        FILE *in = expect(fopen(path("genes").c_str(), "rb"), "[x] Failed to open checkpoint in " + dir);
+        int gene_id;
+        AlignmentSet alignments;
+        for (size_t i = 0; i < done.size() && read_set(in, gene_id, alignments); i++)
+            f(gene_id, move(alignments));
+        fclose(in);
+    }
+
+    /* Append the alignments of a finished gene, may be called from any thread */
+    void save_gene(int gene_id, const AlignmentSet &alignments)
+    {
+        lock_guard<mutex> lock(mtx);
+        write_set(genes_out, gene_id, alignments);
+        expect(fflush(genes_out) == 0 && fsync(fileno(genes_out)) == 0, "[x] Failed to write checkpoint in " + dir);
+    }
+
+    /* Delete the checkpoint once the run is complete */
+    void remove_files()
+    {
+        if (genes_out)
+            fclose(genes_out);
+        genes_out = nullptr;
+        for (const char *file : {"run", "genes", "first_pass", "first_pass.reads", "first_pass.tmp", "first_pass.reads.tmp"})
+            remove(path(file).c_str());
+        rmdir(dir.c_str());
+    }
+
+private:
+    string dir;
+    FILE *genes_out = nullptr;
+    mutex mtx;
+    vector<int> done; // sorted IDs of the genes finished before
+
+    string path(const string &file) const { return dir + "/" + file; }
+
+    /* Index the genes saved before, and cut off a gene left incomplete by a crash so that new genes follow the last good one */
+    void load_genes()
+    {
+        FILE *in = fopen(path("genes").c_str(), "rb");
+        if (!in)
+            return;
+        int gene_id;
+        AlignmentSet alignments;
+        long good_end = 0;
+        while (read_set(in, gene_id, alignments))
+        {
+            done.push_back(gene_id);
+            good_end = ftell(in);
+        }
+        fclose(in);
+        expect(truncate(path("genes").c_str(), good_end) == 0, "[x] Failed to repair checkpoint in " + dir);
+        sort(done.begin(), done.end());
+    }
+
+    static void close_synced(FILE *out)
+    {
+        expect(fflush(out) == 0 && fsync(fileno(out)) == 0, "[x] Failed to write checkpoint");
+        fclose(out);
+    }
+
+    static void write_set(FILE *out, int gene_id, const AlignmentSet &alignments)
+    {
+        uint64_t header[3] = {(uint64_t)(int64_t)gene_id, alignments.records.size(), alignments.cigars.size()};
+        uint64_t checksum = fnv1a(header, sizeof(header));
+        checksum = fnv1a(alignments.records.data(), alignments.records.size() * sizeof(AlignmentRecord), checksum);
+        checksum = fnv1a(alignments.cigars.data(), alignments.cigars.size() * sizeof(uint32_t), checksum);
+        bool written = fwrite(header, sizeof(header), 1, out) == 1;
+        written &= fwrite(alignments.records.data(), sizeof(AlignmentRecord), alignments.records.size(), out) == alignments.records.size();
+        written &= fwrite(alignments.cigars.data(), sizeof(uint32_t), alignments.cigars.size(), out) == alignments.cigars.size();
+        written &= fwrite(&checksum, sizeof(checksum), 1, out) == 1;
+        expect(written, "[x] Failed to write checkpoint");
+    }
+
+    /* Read the next saved set, returns false at the end of the file or at an incomplete or corrupt set */
+    static bool read_set(FILE *in, int &gene_id, AlignmentSet &alignments)
+    {
+        uint64_t header[3], checksum;
+        if (fread(header, sizeof(header), 1, in) != 1 || header[1] > (1ULL << 40) || header[2] > (1ULL << 40))
+            return false;
+        alignments = AlignmentSet();
+        alignments.records.resize(header[1]);
+        alignments.cigars.resize(header[2]);
+        if (fread(alignments.records.data(), sizeof(AlignmentRecord), header[1], in) != header[1] ||
+            fread(alignments.cigars.data(), sizeof(uint32_t), header[2], in) != header[2] ||
+            fread(&checksum, sizeof(checksum), 1, in) != 1)
+            return false;
+        uint64_t expected = fnv1a(header, sizeof(header));
+        expected = fnv1a(alignments.records.data(), alignments.records.size() * sizeof(AlignmentRecord), expected);
+        expected = fnv1a(alignments.cigars.data(), alignments.cigars.size() * sizeof(uint32_t), expected);
+        gene_id = (int)(int64_t)header[0];
+        return checksum == expected;
+    }
+};
+
+#endif
@@ -2,11 +2,22 @@
 #define CLI_H
 
 #include <string>
-#include <fstream>
 #include <vector>
 #include <iostream>
+#include <string_view>
+#include <charconv>
+#include <thread>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "types.hpp"
+#include "helper.hpp"
+#include "thread_pool.hpp"
+#include "binary_format.hpp"
 
 using namespace std;
 
@@ -25,46 +36,206 @@ void print_alignment(const ReadAlignment &alignment)
     cout << endl;
 }
 
-void show_report(const string &alignments_file, const string &kir_id, const string &allele_id, int read_id, int num_results)
+/* Answers the filters from the sidecar index of a binary alignments file, only the matching blocks are read */
+void show_binary_report(const string &alignments_file, const string &kir_id, const string &allele_id, int read_id, int num_results)
 {
-    ifstream alignments(alignments_file);
-    if (!alignments)
+    BinaryAlignmentReader reader(alignments_file);
+    const AlleleDict &dict = reader.dict;
+
+    vector<int> wanted_alleles; // sorted, alleles are numbered gene by gene
+    for (size_t id = 0; id < dict.alleles.size(); id++)
+        if ((kir_id.empty() || dict.gene(id) == kir_id) && (allele_id.empty() || dict.alleles[id] == allele_id))
+            wanted_alleles.push_back(id);
+
+    vector<uint32_t> blocks;
+    if (read_id != -1)
+        blocks = reader.read_blocks(read_id);
+    else if (!wanted_alleles.empty())
+        blocks = reader.allele_blocks(wanted_alleles.front(), wanted_alleles.back());
+
+    int shown = 0;
+    for (uint32_t b : blocks)
     {
-        cerr << "[x] Failed to open alignments file " << alignments_file << endl;
-        return;
+        // Skip blocks whose allele range falls between two wanted alleles
+        auto it = lower_bound(wanted_alleles.begin(), wanted_alleles.end(), reader.blocks[b].min_allele);
+        if (it == wanted_alleles.end() || *it > reader.blocks[b].max_allele)
+            continue;
+
+        AlignmentSet alignments = reader.read_block(b);
+        for (const auto &record : alignments.records)
+        {
+            if (num_results >= 0 && shown == num_results)
+                return;
+            if ((read_id != -1 && record.read_id != read_id) || !binary_search(wanted_alleles.begin(), wanted_alleles.end(), record.allele_id))
+                continue;
+
+            ReadAlignment alignment;
+            alignment.read_id = record.read_id;
+            alignment.kir_id = dict.gene(record.allele_id);
+            alignment.allele_id = dict.alleles[record.allele_id];
+            alignment.reversed = record.reversed;
+            alignment.cost = record.cost;
+            alignment.read_start = record.read_start;
+            alignment.read_end = record.read_end;
+            alignment.query_start = record.query_start;
+            alignment.query_end = record.query_end;
+            for (uint32_t k = record.cigar_offset; k < record.cigar_offset + record.n_cigar; k++)
+                alignment.cigar += to_string(alignments.cigars[k] >> 4) + MM_CIGAR_STR[alignments.cigars[k] & 0xf];
+            print_alignment(alignment);
+            shown++;
+        }
     }
-    string line;
-    while (num_results-- && getline(alignments, line))
+}
+
+const size_t REPORT_CHUNK_SIZE = 16 << 20; // bytes of TSV filtered per task
+
+/* Filters of a report: by read, gene and allele, each unset if empty */
+struct ReportFilter
+{
+    string read_key;
+    string kir_id;
+    string allele_id;
+    int num_results;
+};
+
+/* Prints the matching lines of the TSV text in [data, data + size), which ends at a line break, until shown reaches
+ * the number of results. The text is split into newline-aligned chunks that are filtered in parallel, one wave of
+ * chunks at a time so that --head can stop early. Filters compare the raw bytes of the first three columns, only
+ * matching lines are parsed, and matches are printed in file order. */
+void report_tsv(const char *data, size_t size, const ReportFilter &filter, ThreadPool &pool, int &shown)
+{
+    const string &read_key = filter.read_key, &kir_id = filter.kir_id, &allele_id = filter.allele_id;
+    int num_results = filter.num_results;
+    for (size_t wave_start = 0; wave_start < size && shown != num_results;)
     {
-        ReadAlignment alignment;
-        // split the line by tabs
-        size_t pos = 0;
-        vector<string> fields;
-        while ((pos = line.find('\t')) != string::npos)
+        // Newline-aligned chunk boundaries for this wave
+        vector<size_t> bounds{wave_start};
+        while ((int)bounds.size() <= pool.size() && bounds.back() < size)
         {
-            fields.push_back(line.substr(0, pos));
-            line.erase(0, pos + 1);
+            size_t end = min(bounds.back() + REPORT_CHUNK_SIZE, size);
+            const char *newline = end < size ? (const char *)memchr(data + end, '\n', size - end) : nullptr;
+            bounds.push_back(newline ? newline - data + 1 : size);
         }
-        fields.push_back(line);
-        // parse the fields
-        alignment.read_id = stoi(fields[0]);
-        if (read_id != -1 && alignment.read_id != read_id)
-            continue;
-        alignment.kir_id = fields[1];
-        if (!kir_id.empty() && alignment.kir_id != kir_id)
-            continue;
-        alignment.allele_id = fields[2];
-        if (!allele_id.empty() && alignment.allele_id != allele_id)
-            continue;
-        alignment.reversed = fields[3] == "1";
-        alignment.cost = stoi(fields[4]);
-        alignment.read_start = stoi(fields[5]);
-        alignment.read_end = stoi(fields[6]);
-        alignment.query_start = stoi(fields[7]);
-        alignment.query_end = stoi(fields[8]);
-        alignment.cigar = fields[9];
-        print_alignment(alignment);
+
+        vector<vector<string_view>> matches(bounds.size() - 1);
+        pool.parallel_for(matches.size(), [&](int c)
+                          {
+                              const char *p = data + bounds[c], *chunk_end = data + bounds[c + 1];
+                              while (p < chunk_end)
+                              {
+                                  const char *line_end = (const char *)memchr(p, '\n', chunk_end - p);
+                                  if (!line_end)
+                                      line_end = chunk_end;
+                                  string_view line(p, line_end - p);
+                                  p = line_end + 1;
+                                  if (line.empty())
+                                      continue;
+
+                                  size_t tab1 = line.find('\t'), tab2 = line.find('\t', tab1 + 1), tab3 = line.find('\t', tab2 + 1);
+                                  if (tab3 == string_view::npos)
+                                      continue;
+                                  if ((!read_key.empty() && line.substr(0, tab1) != read_key) ||
+                                      (!kir_id.empty() && line.substr(tab1 + 1, tab2 - tab1 - 1) != kir_id) ||
+                                      (!allele_id.empty() && line.substr(tab2 + 1, tab3 - tab2 - 1) != allele_id))
+                                      continue;
+                                  matches[c].push_back(line);
+                                  if (num_results >= 0 && (int)matches[c].size() == num_results)
+                                      break;
+                              }
+                          });
+
+        for (const auto &chunk_matches : matches)
+            for (string_view line : chunk_matches)
+            {
+                if (shown == num_results)
+                    break;
+                vector<string_view> fields = split_fields(line);
+                if (fields.size() < 10)
+                    continue;
+                ReadAlignment alignment;
+                alignment.read_id = parse_int(fields[0]);
+                alignment.kir_id = fields[1];
+                alignment.allele_id = fields[2];
+                alignment.reversed = fields[3] == "1";
+                alignment.cost = parse_int(fields[4]);
+                alignment.read_start = parse_int(fields[5]);
+                alignment.read_end = parse_int(fields[6]);
+                alignment.query_start = parse_int(fields[7]);
+                alignment.query_end = parse_int(fields[8]);
+                alignment.cigar = fields[9];
+                print_alignment(alignment);
+                shown++;
+            }
+        wave_start = bounds.back();
+    }
+}
+
+/* Whether a file starts with the gzip magic bytes */
+bool is_gzip(const string &file)
+{
+    unsigned char magic[2] = {};
+    FILE *in = fopen(file.c_str(), "rb");
+    if (!in)
+        return false;
+    bool gzip = fread(magic, 1, sizeof(magic), in) == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+    fclose(in);
+    return gzip;
+}
+
+/* A plain TSV is memory-mapped and filtered in place. A gzip-compressed one is inflated by zlib a pool's worth of
+ * chunks at a time, each batch cut at its last line break and filtered the same way. */
+void show_report(const string &alignments_file, const string &kir_id, const string &allele_id, int read_id, int num_results, int n_threads = thread::hardware_concurrency())
+{
+    if (BinaryAlignmentReader::is_binary(alignments_file))
+        return show_binary_report(alignments_file, kir_id, allele_id, read_id, num_results);
+
+    ReportFilter filter{read_id != -1 ? to_string(read_id) : "", kir_id, allele_id, num_results};
+    ThreadPool pool(n_threads);
+    int shown = 0;
+    if (is_gzip(alignments_file))
+    {
+        gzFile in = expect(gzopen(alignments_file.c_str(), "rb"), "[x] Failed to open alignments file " + alignments_file);
+        string text, rest;
+        size_t batch_size = pool.size() * REPORT_CHUNK_SIZE;
+        bool more = true;
+        while (more && shown != num_results)
+        {
+            text.swap(rest);
+            size_t start = text.size();
+            text.resize(start + batch_size);
+            int n = gzread(in, &text[start], batch_size);
+            expect(n >= 0, "[x] Failed to decompress " + alignments_file);
+            text.resize(start + n);
+            more = n > 0;
+            size_t end = more ? text.rfind('\n') + 1 : text.size(); // rfind gives npos + 1 = 0 without a line break
+            rest.assign(text, end, string::npos);
+            report_tsv(text.data(), end, filter, pool, shown);
+        }
+        gzclose(in);
+        return;
     }
+
+    int fd = open(alignments_file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        cerr << "[x] Failed to open alignments file " << alignments_file << endl;
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return;
+    }
+    const char *data = (const char *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    expect(data != MAP_FAILED, "[x] Failed to map alignments file " + alignments_file);
+    close(fd);
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+    report_tsv(data, size, filter, pool, shown);
+    munmap((void *)data, size);
 }
 
 /* Function to print the help message */
@@ -74,22 +245,70 @@ int show_help(const string &program)
          << endl;
     cerr << "Commands:" << endl;
 
-    cerr << "\talign <database> <reads> [--method <method_name>] [-r <num_representatives>] [--pair] [-t <threads>] [-o <output_file>]" << endl;
-    cerr << "\t\tAligns reads to the database and reports the results." << endl;
+    cerr << "\talign <database> <reads> [<mates>] [--method <method_name>] [-r <num_representatives>] [--pair] [-t <threads>] [-o <output_file>] [--cache <cache_dir>] [--stream] [--pack-reads] [--prefilter <min_kmers>] [--dedup] [--genotype <genotype_file>] [--update <previous_output>] [--checkpoint <dir> [--resume]] [--stats <stats_file>]" << endl;
+    cerr << "\t\tAligns reads to the database and reports the results. With <mates>, its reads are the mates of those in <reads>, in the same order, and each pair is mapped as one fragment. Reads are FASTA or FASTQ, plain, gzip or bgzip compressed." << endl;
     cerr << "\tOptions:" << endl;
     cerr << "\t\t--method <method_name>\n"
          << "\t\t\tAlignment method to use. Options are `naive`, `regional`, and `categorical`. Default is `regional`." << endl;
     cerr << "\t\t-r <num_representatives>\n"
-         << "\t\t\tNumber of representative alleles per gene used in `regional` and `categorical` alignment. Default is 1." << endl;
+         << "\t\t\tNumber of representative alleles per gene used in `regional` and `categorical` alignment, picked to cover the sequence diversity of the gene and cached in <database>.representatives. Default is 1." << endl;
     cerr << "\t\t--pair\n"
-         << "\t\t\tWhen performing `regional` or `categorical` alignment, for each read aligned in the first pass, also include its pair in the second pass." << endl;
+         << "\t\t\tTreat <reads> as interleaved pairs and include the mate of each read aligned in the first pass in the second pass. Implied by <mates>." << endl;
     cerr << "\t\t-t <threads>\n"
          << "\t\t\tNumber of threads to use. Default is the number of hardware threads." << endl;
     cerr << "\t\t-o <output_file>\n"
-         << "\t\t\tOutput file to write the results to." << endl;
+         << "\t\t\tOutput file to write the results to, gzip compressed if it ends with `.gz`, or in the indexed binary format if it ends with `.kab`. Files ending in `.paf`, `.sam` or `.bam` are written in PAF, SAM or BAM, with the alleles as references." << endl;
+    cerr << "\t\t--cache <cache_dir>\n"
+         << "\t\t\tDirectory of cached minimap2 indexes. Indexes missing from the cache are built and stored there." << endl;
+    cerr << "\t\t--stream\n"
+         << "\t\t\tWhen performing `regional` or `categorical` alignment, stream the reads through the first pass in chunks and only keep the reads that aligned." << endl;
+    cerr << "\t\t--pack-reads\n"
+         << "\t\t\tStore reads in memory 2-bit encoded." << endl;
+    cerr << "\t\t--prefilter <min_kmers>\n"
+         << "\t\t\tDrop reads that share fewer than <min_kmers> 21-mers with the database before mapping them. Default is 0 (disabled)." << endl;
+    cerr << "\t\t--dedup\n"
+         << "\t\t\tAlign each distinct read sequence once, treating a read and its reverse complement as identical, and copy the results to its duplicates." << endl;
+    cerr << "\t\t--genotype <genotype_file>\n"
+         << "\t\t\tCall the alleles of each gene from its alignments as it finishes, resolving reads that hit several alleles with an EM over allele abundances, and write them ranked with their read support and confidence to <genotype_file>. Works without `-o`." << endl;
+    cerr << "\t\t--update <previous_output>\n"
+         << "\t\t\tAlign again only the genes whose alleles changed since <previous_output> was written, and copy the alignments of the other genes from it. <previous_output> may be the output file itself, which is then replaced." << endl;
+    cerr << "\t\t--checkpoint <dir>\n"
+         << "\t\t\tSave the first pass and each finished gene to <dir> as the run goes, and remove them once the run completes." << endl;
+    cerr << "\t\t--resume\n"
+         << "\t\t\tResume an interrupted run from its --checkpoint directory, skipping the first pass and the genes it finished. The reads, options and database must be the same." << endl;
+    cerr << "\t\t--stats <stats_file>\n"
+         << "\t\t\tWrite the wall and CPU time of each stage, gene and region, and the mapping counters, to <stats_file> as JSON." << endl;
+
+    cerr << "\n\talign-batch <database> <manifest> [--max-samples <n>] [--genotype] [--update] [--checkpoint <dir> [--resume]] [align options except -o]" << endl;
+    cerr << "\t\tAligns several samples, loading the database, representatives and indexes once and sharing one thread pool." << endl;
+    cerr << "\t\tEach line of <manifest> is `<reads_file> [<mates_file>] <output_file>`, lines starting with `#` are skipped." << endl;
+    cerr << "\tOptions:" << endl;
+    cerr << "\t\t--max-samples <n>\n"
+         << "\t\t\tNumber of samples aligned at the same time, which bounds how many samples' reads are in memory. Default is 2." << endl;
+    cerr << "\t\t--genotype\n"
+         << "\t\t\tWrite the genotype of each sample to its output file instead of its alignments." << endl;
+    cerr << "\t\t--update\n"
+         << "\t\t\tUpdate each output file in place, aligning again only the genes whose alleles changed since it was written." << endl;
+    cerr << "\t\t--checkpoint <dir> [--resume]\n"
+         << "\t\t\tCheckpoint each sample in a subdirectory of <dir>, and with --resume resume the samples of an interrupted batch." << endl;
+    cerr << "\n\tserve <database> <socket_path> [--max-jobs <n>] [align options except -o and --stats]" << endl;
+    cerr << "\t\tKeeps the database and all indexes loaded and aligns jobs sent to the Unix socket <socket_path>." << endl;
+    cerr << "\t\tRequests are `align <reads_file> [<mates_file>] <output_file> [--method <m>] [-r <n>] [--pair] [--stream] [--dedup] [--pack-reads] [--genotype] [--update]`, `status [<job_id>]`, `metrics` and `shutdown`." << endl;
+    cerr << "\tOptions:" << endl;
+    cerr << "\t\t--max-jobs <n>\n"
+         << "\t\t\tNumber of jobs aligned at the same time, further jobs are queued. Default is 2." << endl;
+    cerr << "\n\trequest <socket_path> <request...>" << endl;
+    cerr << "\t\tSends a request to a running `serve` and prints the reply." << endl;
+    cerr << "\n\tindex <database> <cache_dir> [-r <num_representatives>] [-t <threads>]" << endl;
+    cerr << "\t\tBuilds the indexes of each gene and of the representative alleles into <cache_dir>. Indexes already in <cache_dir> are kept, so after a database update only those of the changed genes are built." << endl;
+    cerr << "\tOptions:" << endl;
+    cerr << "\t\t-r <num_representatives>\n"
+         << "\t\t\tNumber of representative alleles per gene, should match the `-r` used with `align`. Default is 1." << endl;
+    cerr << "\t\t-t <threads>\n"
+         << "\t\t\tNumber of threads to use. Default is the number of hardware threads." << endl;
 
-    cerr << "\n\treport <alignments_file> [--head <num_results>] [-r <read read_id>] [-k <KIR read_id>] [-a <allele read_id>]" << endl;
-    cerr << "\t\tReports the results from a previously generated alignments file." << endl;
+    cerr << "\n\treport <alignments_file> [--head <num_results>] [-r <read read_id>] [-k <KIR read_id>] [-a <allele read_id>] [-t <threads>]" << endl;
+    cerr << "\t\tReports the results from a previously generated alignments file. Filters on `.kab` files only read the matching blocks." << endl;
     cerr << "\tOptions:" << endl;
     cerr << "\t\t--head <num_results>\n"
          << "\t\t\tShow only the first <num_results> results." << endl;
@@ -99,6 +318,8 @@ int show_help(const string &program)
          << "\t\t\tShow only alignments for the specified KIR." << endl;
     cerr << "\t\t-a <allele read_id>\n"
          << "\t\t\tShow only alignments for the specified allele." << endl;
+    cerr << "\t\t-t <threads>\n"
+         << "\t\t\tNumber of threads scanning a TSV alignments file. Default is the number of hardware threads." << endl;
     return 1; // Return error code
 }
 
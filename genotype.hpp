@@ -0,0 +1,227 @@
+#ifndef GENOTYPE_H
+#define GENOTYPE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <limits>
+
+#include "helper.hpp"
+#include "alignment.hpp"
+#include "stats.hpp"
+
+using namespace std;
+
+/* Log-likelihood ratio of a mismatch to a match, for a per-base error rate of 1% spread over the 3 other bases */
+const double MISMATCH_LOG_LIKELIHOOD = log(0.01 / 3 / 0.99);
+
+/* Alleles called with less than this share of their gene's reads are not reported */
+const double MIN_ABUNDANCE = 0.01;
+
+/* Per-gene allele calls, computed from each gene's alignments as soon as the gene is done so that only the calls are kept
+ *
+ * A read (or a pair, when paired) supports every allele it hits, weighted by the likelihood of its mismatches there, and
+ * an EM estimates the allele abundances that best explain all reads of the gene. Reads that hit the same alleles with the
+ * same mismatches are resolved together, so a gene costs time in its distinct hit patterns rather than its reads.
+ * Each call reports:
+ *   abundance     estimated share of the gene's reads coming from the allele
+ *   reads         expected number of reads from the allele
+ *   unique_reads  reads that hit the allele better than any other
+ *   confidence    mean share of the allele in its supporting reads, 1 when none of them could come from another allele */
+class Genotyper
+{
+public:
+    Genotyper(const AlleleDict &dict, bool paired) : dict(dict), paired(paired) {}
+
+    /* Call the alleles of a gene from its sorted alignments, may be called from any thread */
+    void add(int gene_id, const AlignmentSet &alignments)
+    {
+        StageTimer timer("genotype.gene", dict.genes[gene_id], false);
+        auto gene_calls = call(support_classes(alignments));
+        lock_guard<mutex> lock(mtx);
+        calls[gene_id] = move(gene_calls);
+    }
+
+    /* Write the calls as `<gene> <rank> <allele> <abundance> <reads> <unique_reads> <confidence>`, by gene then rank */
+    void save(const string &genotype_file)
+    {
+        FILE *out = expect(fopen(genotype_file.c_str(), "w"), "[-] Error: Unable to open file " + genotype_file + " for writing.");
+        fprintf(out, "#gene\trank\tallele\tabundance\treads\tunique_reads\tconfidence\n");
+        lock_guard<mutex> lock(mtx);
+        for (const auto &gene : calls)
+            for (size_t rank = 0; rank < gene.second.size(); rank++)
+            {
+                const Call &c = gene.second[rank];
+                fprintf(out, "%s\t%zu\t%s\t%.4f\t%.1f\t%zu\t%.4f\n", dict.genes[gene.first].c_str(), rank + 1, dict.alleles[c.allele_id].c_str(),
+                        c.abundance, c.reads, c.unique_reads, c.confidence);
+            }
+        fclose(out);
+    }
+
+    size_t n_genes()
+    {
+        lock_guard<mutex> lock(mtx);
+        return calls.size();
+    }
+
+private:
+    struct Call
+    {
+        int allele_id;
+        double abundance;
+        double reads;
+        size_t unique_reads;
+        double confidence;
+    };
+
+    /* Reads that hit the same alleles with the same extra mismatches over their best hit */
+    struct SupportClass
+    {
+        vector<pair<int, int>> hits; // (allele ID, mismatches over the read's best hit)
+        size_t n_reads = 0;
+    };
+
+    const AlleleDict &dict;
+    bool paired;
+    mutex mtx;
+    map<int, vector<Call>> calls;
+
+    /* Group the reads of a gene by the alleles they hit and how well
+     * Mismatches of a hit include the unaligned ends of the read, and only the best hit of a read on each allele counts.
+     * Mates are scored together on the alleles they both hit, or apart if they share none. */
+    vector<SupportClass> support_classes(const AlignmentSet &alignments)
+    {
+        map<int, map<int, int>> read_hits; // read ID to allele ID to mismatches, up to the read length
+        for (const auto &alignment : alignments.records)
+        {
+            int mismatches = alignment.cost + alignment.read_start - alignment.read_end;
+            auto it = read_hits[alignment.read_id].emplace(alignment.allele_id, mismatches).first;
+            it->second = min(it->second, mismatches);
+        }
+
+        vector<map<int, int>> fragments;
+        for (auto it = read_hits.begin(); it != read_hits.end(); ++it)
+        {
+            auto mate = next(it);
+            if (paired && it->first % 2 == 0 && mate != read_hits.end() && mate->first == it->first + 1)
+            {
+                map<int, int> shared;
+                for (const auto &hit : it->second)
+                {
+                    auto mate_hit = mate->second.find(hit.first);
+                    if (mate_hit != mate->second.end())
+                        shared[hit.first] = hit.second + mate_hit->second;
+                }
+                if (!shared.empty())
+                {
+                    fragments.push_back(move(shared));
+                    it = mate;
+                    continue;
+                }
+            }
+            fragments.push_back(move(it->second));
+        }
+
+        map<vector<pair<int, int>>, size_t> class_reads;
+        for (const auto &fragment : fragments)
+        {
+            int best = numeric_limits<int>::max();
+            for (const auto &hit : fragment)
+                best = min(best, hit.second);
+            vector<pair<int, int>> hits;
+            for (const auto &hit : fragment)
+                hits.push_back({hit.first, hit.second - best});
+            class_reads[hits]++;
+        }
+        vector<SupportClass> classes;
+        for (auto &entry : class_reads)
+            classes.push_back({entry.first, entry.second});
+        return classes;
+    }
+
+    /* EM over the abundances of the alleles hit, then rank the alleles by abundance */
+    vector<Call> call(const vector<SupportClass> &classes)
+    {
+        map<int, int> allele_index;
+        for (const auto &support : classes)
+            for (const auto &hit : support.hits)
+                allele_index.emplace(hit.first, allele_index.size());
+        size_t n_alleles = allele_index.size();
+        if (n_alleles == 0)
+            return {};
+
+        // Likelihood of each class's hits relative to its best hit
+        vector<vector<pair<int, double>>> likelihoods(classes.size());
+        double n_reads = 0;
+        for (size_t c = 0; c < classes.size(); c++)
+        {
+            for (const auto &hit : classes[c].hits)
+                likelihoods[c].push_back({allele_index[hit.first], exp(hit.second * MISMATCH_LOG_LIKELIHOOD)});
+            n_reads += classes[c].n_reads;
+        }
+
+        vector<double> abundance(n_alleles, 1.0 / n_alleles), expected(n_alleles);
+        for (int iteration = 0; iteration < 1000; iteration++)
+        {
+            fill(expected.begin(), expected.end(), 0);
+            for (size_t c = 0; c < classes.size(); c++)
+            {
+                double total = 0;
+                for (const auto &[a, l] : likelihoods[c])
+                    total += abundance[a] * l;
+                if (total > 0)
+                    for (const auto &[a, l] : likelihoods[c])
+                        expected[a] += classes[c].n_reads * abundance[a] * l / total;
+            }
+            double change = 0;
+            for (size_t a = 0; a < n_alleles; a++)
+            {
+                double updated = expected[a] / n_reads;
+                change = max(change, fabs(updated - abundance[a]));
+                abundance[a] = updated;
+            }
+            if (change < 1e-7)
+                break;
+        }
+
+        // Final responsibilities give each allele's reads, unique reads and confidence
+        vector<Call> gene_calls(n_alleles);
+        vector<double> squared(n_alleles);
+        for (const auto &[allele_id, a] : allele_index)
+            gene_calls[a] = {allele_id, abundance[a], 0, 0, 0};
+        for (size_t c = 0; c < classes.size(); c++)
+        {
+            double total = 0;
+            for (const auto &[a, l] : likelihoods[c])
+                total += abundance[a] * l;
+            int n_best = 0;
+            for (const auto &hit : classes[c].hits)
+                n_best += hit.second == 0;
+            for (size_t h = 0; h < likelihoods[c].size(); h++)
+            {
+                auto [a, l] = likelihoods[c][h];
+                double share = total > 0 ? abundance[a] * l / total : 0;
+                gene_calls[a].reads += classes[c].n_reads * share;
+                squared[a] += classes[c].n_reads * share * share;
+                if (n_best == 1 && classes[c].hits[h].second == 0)
+                    gene_calls[a].unique_reads += classes[c].n_reads;
+            }
+        }
+        for (size_t a = 0; a < n_alleles; a++)
+            gene_calls[a].confidence = gene_calls[a].reads > 0 ? squared[a] / gene_calls[a].reads : 0;
+
+        sort(gene_calls.begin(), gene_calls.end(), [](const Call &a, const Call &b)
+             { return a.abundance != b.abundance ? a.abundance > b.abundance : a.allele_id < b.allele_id; });
+        size_t n_kept = 1; // the top allele is always reported
+        while (n_kept < gene_calls.size() && gene_calls[n_kept].abundance >= MIN_ABUNDANCE)
+            n_kept++;
+        gene_calls.resize(n_kept);
+        return gene_calls;
+    }
+};
+
+#endif
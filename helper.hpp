@@ -2,6 +2,11 @@
 #define HELPER_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <fstream>
+#include <stdexcept>
 
 using namespace std;
 
@@ -20,4 +25,31 @@ void cleanup(const string &file)
     expect(!remove(file.c_str()), "Error deleting file " + file);
 }
 
+/* Helper function to check if a file exists */
+bool file_exists(const string &file)
+{
+    return ifstream(file).good();
+}
+
+/* Fields of a TSV alignment line, split without copying */
+vector<string_view> split_fields(string_view line)
+{
+    vector<string_view> fields;
+    size_t start = 0, pos;
+    while ((pos = line.find('\t', start)) != string_view::npos)
+    {
+        fields.push_back(line.substr(start, pos - start));
+        start = pos + 1;
+    }
+    fields.push_back(line.substr(start));
+    return fields;
+}
+
+int parse_int(string_view field)
+{
+    int value = 0;
+    from_chars(field.data(), field.data() + field.size(), value);
+    return value;
+}
+
 #endif
\ No newline at end of file
@@ -6,10 +6,27 @@
 #include <zlib.h>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
 
 #include "types.hpp"
 #include "helper.hpp"
+#include "read_store.hpp"
+#include "reads_input.hpp"
+#include "alignment.hpp"
+#include "prefilter.hpp"
+#include "thread_pool.hpp"
+#include "stats.hpp"
 #include "minimap2/kseq.h"
 #include "minimap2/minimap.h"
 
@@ -40,101 +57,544 @@ unordered_map<string, unordered_map<string, string>> load_kirs(const string &dat
     return kirs;
 }
 
-unordered_map<int, string> load_reads(const string &reads)
+/* The given reads and the mates of those that are paired, in increasing ID order */
+vector<int> with_mates(const ReadStore &reads, const vector<int> &read_ids)
 {
-    int r_id = 0;
-    unordered_map<int, string> reads_map;
-    gzFile readsFileIn = expect(gzopen(reads.c_str(), "r"), "Failed to open reads file");
-    kseq_t *seq = kseq_init(readsFileIn);
-    while (kseq_read(seq) >= 0)
-        reads_map[r_id++] = seq->seq.s;
-    kseq_destroy(seq);
-    gzclose(readsFileIn);
-    return reads_map;
+    vector<int> ids = read_ids;
+    for (int read_id : read_ids)
+        if (reads.contains(get_pair_id(read_id)))
+            ids.push_back(get_pair_id(read_id));
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+/* Reads of a FASTA/FASTQ file, or the pairs of an R1 and an R2 file interleaved so that reads 2p and 2p + 1 are mates
+ * Each file is decompressed and parsed ahead on its own FastxReader, BGZF blocks are inflated on the pool if given */
+class ReadsReader
+{
+public:
+    ReadsReader(const string &reads_file, const string &mates_file = "", ThreadPool *pool = nullptr)
+    {
+        files.push_back(make_unique<FastxReader>(reads_file, pool));
+        if (!mates_file.empty())
+            files.push_back(make_unique<FastxReader>(mates_file, pool));
+    }
+
+    bool paired() const { return files.size() == 2; }
+
+    /* Add the next read, or the next pair, to the store, returns false at the end of the input */
+    bool read(ReadStore &store)
+    {
+        string_view names[2], seqs[2];
+        bool first = files[0]->next(names[0], seqs[0]);
+        if (paired())
+        {
+            bool second = files[1]->next(names[1], seqs[1]);
+            expect(first == second, "[x] Mate files have different numbers of reads");
+            if (first)
+                expect(mate_name(names[0]) == mate_name(names[1]), "[x] Mates are not in the same order: " + string(names[0]) + " and " + string(names[1]));
+        }
+        if (!first)
+            return false;
+        for (size_t i = 0; i < files.size(); i++)
+            store.add(next_id++, seqs[i].data(), seqs[i].size());
+        return true;
+    }
+
+private:
+    vector<unique_ptr<FastxReader>> files;
+    int next_id = 0;
+
+    /* Read name without its `/1` or `/2` suffix */
+    static string_view mate_name(string_view name)
+    {
+        if (name.size() > 2 && name[name.size() - 2] == '/' && (name.back() == '1' || name.back() == '2'))
+            name.remove_suffix(2);
+        return name;
+    }
+};
+
+/* Load all reads, with mates_file the reads are paired with the mates in it */
+ReadStore load_reads(const string &reads, bool packed = false, const string &mates_file = "", ThreadPool *pool = nullptr)
+{
+    ReadStore reads_store(packed);
+    ReadsReader reader(reads, mates_file, pool);
+    reads_store.paired = reader.paired();
+    while (reader.read(reads_store))
+        ;
+    return reads_store;
 }
 
-const string reindex_reads(const unordered_map<int, string> &reads_map)
+/* Named sequences to build a minimap2 index from, names are `<gene>.<allele>` */
+struct IndexSequences
+{
+    vector<string> names;
+    vector<string> seqs;
+    vector<int> allele_ids; // allele ID of each sequence, hits are reported against it
+
+    void add(const string &name, const string &seq, int allele_id = -1)
+    {
+        names.push_back(name);
+        seqs.push_back(seq);
+        allele_ids.push_back(allele_id);
+    }
+
+    size_t size() const { return names.size(); }
+};
+
+/* Number of alleles indexed together, so that genes with many alleles are split over several tasks */
+const int ALLELE_CHUNK_SIZE = 64;
+
+/* The alleles of a gene in name order */
+IndexSequences gene_sequences(const AlleleDict &dict, const string &gene_name, const unordered_map<string, string> &alleles)
 {
-    string reads_fasta = "reads_indexed.fa";
-    ofstream reads_fasta_file(reads_fasta);
-    for (const auto &read : reads_map)
-        reads_fasta_file << ">" << read.first << "\n"
-                         << read.second << "\n";
-    reads_fasta_file.close();
-    return reads_fasta;
+    vector<string> allele_names;
+    for (const auto &allele : alleles)
+        allele_names.push_back(allele.first);
+    sort(allele_names.begin(), allele_names.end());
+
+    IndexSequences sequences;
+    for (const auto &allele_name : allele_names)
+        sequences.add(gene_name + "." + allele_name, alleles.at(allele_name), dict.allele_id(gene_name, allele_name));
+    return sequences;
 }
 
-const string extract_representatives(const unordered_map<string, unordered_map<string, string>> &kirs, int num_representatives)
+/* Sequences grouped into classes of identical bases, so that each distinct sequence is indexed and aligned once
+ * The first sequence of a class stands for it, and its hits are copied to the other members */
+struct AlleleClasses
 {
-    string representatives_file = "representatives.fa";
-    ofstream representatives(representatives_file);
-    for (const auto &gene : kirs)
-        // Choose n random alleles to represent the gene
-        for (int i = 0; i < num_representatives; i++)
+    IndexSequences unique;                   // first sequence of each class, in the original order
+    unordered_map<int, vector<int>> members; // allele IDs of each class by the allele ID of its first sequence
+
+    explicit AlleleClasses(const IndexSequences &sequences)
+    {
+        unordered_map<string_view, int> first; // sequence to the allele ID of its first occurrence
+        for (size_t i = 0; i < sequences.size(); i++)
         {
-            auto allele = next(gene.second.begin(), rand() % gene.second.size());
-            representatives << ">" << gene.first << "." << allele->first << "\n"
-                            << allele->second << "\n";
+            auto it = first.emplace(sequences.seqs[i], sequences.allele_ids[i]);
+            if (it.second)
+                unique.add(sequences.names[i], sequences.seqs[i], sequences.allele_ids[i]);
+            members[it.first->second].push_back(sequences.allele_ids[i]);
         }
-    representatives.close();
-    return representatives_file;
+    }
+
+    /* The unique sequences, split into chunks of at most ALLELE_CHUNK_SIZE */
+    vector<IndexSequences> chunks() const
+    {
+        vector<IndexSequences> chunks((unique.size() + ALLELE_CHUNK_SIZE - 1) / ALLELE_CHUNK_SIZE);
+        for (size_t i = 0; i < unique.size(); i++)
+            chunks[i / ALLELE_CHUNK_SIZE].add(unique.names[i], unique.seqs[i], unique.allele_ids[i]);
+        return chunks;
+    }
+
+    /* Hits on the unique sequences copied to every member of their class */
+    AlignmentSet expand(const AlignmentSet &alignments) const
+    {
+        AlignmentSet expanded;
+        for (const auto &record : alignments.records)
+            for (int allele_id : members.at(record.allele_id))
+            {
+                AlignmentRecord copy = record;
+                copy.allele_id = allele_id;
+                expanded.add(copy, alignments);
+            }
+        return expanded;
+    }
+};
+
+/* FNV-1a hash, used to key cached indexes by their content */
+uint64_t fnv1a(const void *data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
 }
 
-unordered_map<string, unordered_map<string, vector<ReadAlignment>>> align_minimap(
-    const string &kirdb, const string &reads, int n_threads, int max_num_mismatches = 5)
+/* Content hash of the alleles of a gene, from gene_sequences, which changes when an allele is added, removed or edited */
+uint64_t gene_hash(const IndexSequences &alleles, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    for (size_t i = 0; i < alleles.size(); i++)
+    {
+        hash = fnv1a(alleles.names[i].c_str(), alleles.names[i].size() + 1, hash); // include the terminating null as a separator
+        hash = fnv1a(alleles.seqs[i].c_str(), alleles.seqs[i].size() + 1, hash);
+    }
+    return hash;
+}
+
+/* Key of the minimap2 index of a set of sequences, from the sequences and the index options */
+uint64_t index_key(const IndexSequences &sequences, const mm_idxopt_t &iopt)
+{
+    uint64_t hash = fnv1a(&iopt.k, sizeof(iopt.k));
+    hash = fnv1a(&iopt.w, sizeof(iopt.w), hash);
+    hash = fnv1a(&iopt.flag, sizeof(iopt.flag), hash);
+    hash = fnv1a(&iopt.bucket_bits, sizeof(iopt.bucket_bits), hash);
+    return gene_hash(sequences, hash);
+}
+
+/* Path of the cached minimap2 index of a set of sequences, keyed by the sequences and the index options */
+string index_cache_path(const IndexSequences &sequences, const mm_idxopt_t &iopt, const string &cache_dir)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mmi", (unsigned long long)index_key(sequences, iopt));
+    return cache_dir + "/" + name;
+}
+
+void set_minimap_options(mm_idxopt_t &iopt, mm_mapopt_t &mopt)
 {
-    mm_idxopt_t iopt;
-    mm_mapopt_t mopt;
     expect(!mm_set_opt(0, &iopt, &mopt), "Failed to set minimap options");
     mopt.flag |= MM_F_SR;         // -x sr: Short-read preset
     mopt.flag |= MM_F_CIGAR;      // -c: Calculate CIGAR strings
     mopt.flag |= MM_F_ALL_CHAINS; // -P: Retain all chains and don’t attempt to set primary chains
+}
 
-    // Open query file
-    gzFile readsFile = expect(gzopen(reads.c_str(), "r"), "Failed to open reads file");
-    kseq_t *ks = kseq_init(readsFile);
+/* Build the index of a set of sequences in memory, or load it from the cache if it was built before */
+mm_idx_t *build_index(const IndexSequences &sequences, const mm_idxopt_t &iopt, const string &index_cache = "")
+{
+    ScopedNanos timer(stats.index_ns);
+    string cached_index;
+    if (!index_cache.empty())
+    {
+        cached_index = index_cache_path(sequences, iopt, index_cache);
+        FILE *index_file = fopen(cached_index.c_str(), "rb");
+        if (index_file)
+        {
+            mm_idx_t *mi = mm_idx_load(index_file);
+            fclose(index_file);
+            if (mi)
+                return mi;
+        }
+    }
 
-    unordered_map<string, unordered_map<string, vector<ReadAlignment>>> alignments;
-    mm_idx_reader_t *r = mm_idx_reader_open(kirdb.c_str(), &iopt, NULL);
-    mm_idx_t *mi; // minimap2 index
-    while ((mi = mm_idx_reader_read(r, n_threads)) != 0)
+    vector<const char *> seqs, names;
+    for (size_t i = 0; i < sequences.size(); i++)
     {
-        mm_mapopt_update(&mopt, mi);      // this sets the maximum minimizer occurrence
-        mm_tbuf_t *tbuf = mm_tbuf_init(); // thread buffer; for multi-threading, allocate one tbuf for each thread
-        gzrewind(readsFile);
-        kseq_rewind(ks);
-        while (kseq_read(ks) >= 0)
+        seqs.push_back(sequences.seqs[i].c_str());
+        names.push_back(sequences.names[i].c_str());
+    }
+    mm_idx_t *mi = expect(mm_idx_str(iopt.w, iopt.k, iopt.flag & MM_I_HPC, iopt.bucket_bits, sequences.size(), seqs.data(), names.data()), "Failed to build index");
+
+    if (!cached_index.empty())
+    {
+        // unique per process and thread, so concurrent builds of the same index don't collide
+        string index_out = cached_index + "." + to_string(getpid()) + "_" + to_string(hash<thread::id>{}(this_thread::get_id())) + ".tmp";
+        FILE *index_file = expect(fopen(index_out.c_str(), "wb"), "Failed to open " + index_out);
+        mm_idx_dump(index_file, mi);
+        // A partly written index must not be stored, later runs would load it as valid
+        bool written = !ferror(index_file);
+        if (fclose(index_file) != 0 || !written)
         {
-            mm_reg1_t *reg;
-            int j, n_reg;
-            reg = mm_map(mi, ks->seq.l, ks->seq.s, &n_reg, tbuf, &mopt, NULL); // get all hits for the query
-            for (j = 0; j < n_reg; ++j)
+            remove(index_out.c_str());
+            mm_idx_destroy(mi);
+            throw runtime_error("Failed to write index " + index_out);
+        }
+        expect(!rename(index_out.c_str(), cached_index.c_str()), "Failed to store index " + cached_index);
+    }
+    return mi;
+}
+
+/* Where mapping gets its indexes from: built (or loaded from the cache directory) on each use, or, when resident, built
+ * once and kept in memory for the whole run, e.g. across the samples of a batch */
+class IndexStore
+{
+public:
+    explicit IndexStore(const string &index_cache = "", bool resident = false) : index_cache(index_cache), resident(resident) {}
+
+    ~IndexStore()
+    {
+        for (auto &entry : entries)
+            if (entry.second->index)
+                mm_idx_destroy(entry.second->index);
+    }
+
+    /* Index of the sequences, to hand back with release once done mapping */
+    mm_idx_t *acquire(const IndexSequences &sequences, const mm_idxopt_t &iopt)
+    {
+        if (!resident)
+            return build_index(sequences, iopt, index_cache);
+
+        shared_ptr<Entry> entry;
+        {
+            lock_guard<mutex> lock(mtx);
+            auto &slot = entries[index_key(sequences, iopt)];
+            if (!slot)
+                slot = make_shared<Entry>();
+            entry = slot;
+        }
+        call_once(entry->built, [&]()
+                  { entry->index = build_index(sequences, iopt, index_cache); });
+        return entry->index;
+    }
+
+    void release(mm_idx_t *index)
+    {
+        if (!resident)
+            mm_idx_destroy(index);
+    }
+
+private:
+    struct Entry
+    {
+        once_flag built;
+        mm_idx_t *index = nullptr;
+    };
+
+    string index_cache;
+    bool resident;
+    mutex mtx;
+    unordered_map<uint64_t, shared_ptr<Entry>> entries;
+};
+
+/* Convert the hits of a read to alignments, keeping only those within the mismatch limit */
+void add_alignments(const vector<int> &allele_ids, mm_reg1_t *reg, int n_reg, int read_id, int read_len, int max_num_mismatches, AlignmentSet &alignments)
+{
+    for (int j = 0; j < n_reg; ++j)
+    {
+        int num_mismatches = reg[j].blen - reg[j].mlen + reg[j].p->n_ambi;
+        if (num_mismatches + read_len - (reg[j].re - reg[j].rs) > max_num_mismatches)
+        {
+            free(reg[j].p);
+            continue;
+        }
+        AlignmentRecord match = {read_id, allele_ids[reg[j].rid], num_mismatches, reg[j].qs, reg[j].qe, reg[j].rs, reg[j].re, 0, 0, reg[j].rev != 0};
+        alignments.add(match, reg[j].p->cigar, reg[j].p->n_cigar); // this gives the CIGAR in the aligned regions. NO soft/hard clippings!
+        free(reg[j].p);
+    }
+    free(reg);
+}
+
+/* Add the hits of both mates of a pair, keeping only those that form a proper pair if any do
+ * Pairs without any proper hit keep all their hits, e.g. when one mate is unmapped or falls outside a region.
+ * Returns the number of hits dropped. */
+size_t add_pair_alignments(const AlignmentSet &first, const AlignmentSet &second, AlignmentSet &alignments)
+{
+    vector<char> first_proper(first.size()), second_proper(second.size());
+    bool any_proper = false;
+    for (size_t i = 0; i < first.size(); i++)
+        for (size_t j = 0; j < second.size(); j++)
+            if (is_proper_pair(first.records[i], second.records[j]))
             {
-                int num_mismatches = reg[j].blen - reg[j].mlen + reg[j].p->n_ambi;
-                if (num_mismatches + (int)ks->seq.l - (reg[j].re - reg[j].rs) > max_num_mismatches)
-                    continue;
-                string kir_key = string(mi->seq[reg[j].rid].name);
-                auto pos = kir_key.find('.');
-                string gene_key = kir_key.substr(0, pos);
-                string allele_key = kir_key.substr(pos + 1);
-                string cigar;
-                for (uint32_t k = 0; k < reg[j].p->n_cigar; k++) // this gives the CIGAR in the aligned regions. NO soft/hard clippings!
-                    cigar += to_string(reg[j].p->cigar[k] >> 4) + MM_CIGAR_STR[reg[j].p->cigar[k] & 0xf];
-                ReadAlignment match = {stoi(ks->name.s), gene_key, allele_key, reg[j].rev != 0, num_mismatches, reg[j].rs, reg[j].re, reg[j].qs, reg[j].qe, cigar};
-                alignments[gene_key][allele_key].push_back(match);
-                free(reg[j].p);
+                first_proper[i] = second_proper[j] = true;
+                any_proper = true;
             }
-            free(reg);
+
+    size_t n_dropped = 0;
+    for (size_t i = 0; i < first.size(); i++)
+        if (!any_proper || first_proper[i])
+            alignments.add(first.records[i], first);
+        else
+            n_dropped++;
+    for (size_t j = 0; j < second.size(); j++)
+        if (!any_proper || second_proper[j])
+            alignments.add(second.records[j], second);
+        else
+            n_dropped++;
+    return n_dropped;
+}
+
+/* Number of reads a mapping worker takes at a time */
+const int MAP_BATCH_SIZE = 1024;
+
+/* Copy the hits of each distinct read to all the given reads with the same sequence, in the order of read_ids
+ * Hits of reverse-complement duplicates are flipped to the other strand */
+AlignmentSet expand_duplicates(const AlignmentSet &distinct_alignments, const ReadStore &reads, const vector<int> &read_ids)
+{
+    // Hits of a read are contiguous, as reads are mapped in order
+    unordered_map<int, pair<size_t, size_t>> read_hits;
+    const auto &records = distinct_alignments.records;
+    for (size_t begin = 0, end; begin < records.size(); begin = end)
+    {
+        for (end = begin + 1; end < records.size() && records[end].read_id == records[begin].read_id; end++)
+            ;
+        read_hits[records[begin].read_id] = {begin, end};
+    }
+
+    AlignmentSet alignments;
+    for (int read_id : read_ids)
+    {
+        auto hits = read_hits.find(reads.representative(read_id));
+        if (hits == read_hits.end())
+            continue;
+        bool flip = reads.is_reverse_of_representative(read_id);
+        int read_len = reads.length(read_id);
+        for (size_t i = hits->second.first; i < hits->second.second; i++)
+        {
+            AlignmentRecord record = records[i];
+            record.read_id = read_id;
+            if (flip)
+            {
+                record.reversed = !record.reversed;
+                record.read_start = read_len - records[i].read_end;
+                record.read_end = read_len - records[i].read_start;
+            }
+            alignments.add(record, distinct_alignments);
         }
-        mm_tbuf_destroy(tbuf); // deallocate the thread buffer
-        mm_idx_destroy(mi);    // deallocate the index
     }
+    return alignments;
+}
+
+/* Map the given reads from the read store against a built index of the given alleles */
+AlignmentSet map_reads(
+    const mm_idx_t *mi, const mm_mapopt_t &mopt, const vector<int> &allele_ids, const ReadStore &reads, const vector<int> &read_ids, ThreadPool &pool, int max_num_mismatches = 5)
+{
+    // With deduplicated reads, only the first read of each distinct sequence is mapped
+    // (paired reads are never deduplicated, their mates are needed to map them as fragments)
+    if (reads.deduplicated())
+    {
+        vector<int> distinct_ids;
+        unordered_map<int, int> seen;
+        for (int read_id : read_ids)
+            if (seen.insert({reads.representative(read_id), 0}).second)
+                distinct_ids.push_back(reads.representative(read_id));
+        if (distinct_ids != read_ids)
+            return expand_duplicates(map_reads(mi, mopt, allele_ids, reads, distinct_ids, pool, max_num_mismatches), reads, read_ids);
+    }
+
+    // Paired reads whose mate is also to be mapped are mapped together as one fragment, so that minimap2 chains the
+    // mates jointly and improper hits can be dropped
+    mm_mapopt_t frag_mopt = mopt;
+    frag_mopt.flag |= MM_F_FRAG_MODE;
+    frag_mopt.pe_ori = 0 << 1 | 1; // forward-reverse
+    frag_mopt.max_frag_len = MAX_FRAGMENT_LENGTH;
+    auto is_pair_start = [&](size_t i)
+    { return reads.paired && read_ids[i] % 2 == 0 && i + 1 < read_ids.size() && read_ids[i + 1] == read_ids[i] + 1; };
+
+    // Map the reads in fixed-size batches spread over the pool, a pair that straddles a batch boundary goes to the first
+    int n_batches = (read_ids.size() + MAP_BATCH_SIZE - 1) / MAP_BATCH_SIZE;
+    vector<AlignmentSet> batch_alignments(n_batches);
+    pool.parallel_for(n_batches, [&](int batch)
+                      {
+                          ScopedNanos timer(stats.map_ns);
+                          mm_tbuf_t *tbuf = mm_tbuf_init(); // thread buffer, one per batch
+                          string buffer, mate_buffer;       // decoded reads, when reads are packed
+                          size_t batch_start = (size_t)batch * MAP_BATCH_SIZE, batch_end = min(read_ids.size(), batch_start + MAP_BATCH_SIZE);
+                          if (batch_start > 0 && is_pair_start(batch_start - 1))
+                              batch_start++;
+                          if (batch_end < read_ids.size() && is_pair_start(batch_end - 1))
+                              batch_end++;
+                          uint64_t n_hits = 0, n_improper = 0, n_pairs = 0;
+                          for (size_t i = batch_start; i < batch_end; i++)
+                          {
+                              string_view read = reads.get(read_ids[i], buffer);
+                              if (is_pair_start(i))
+                              {
+                                  string_view mate = reads.get(read_ids[i + 1], mate_buffer);
+                                  int qlens[2] = {(int)read.size(), (int)mate.size()}, n_regs[2];
+                                  const char *seqs[2] = {read.data(), mate.data()};
+                                  mm_reg1_t *regs[2];
+                                  mm_map_frag(mi, 2, qlens, seqs, n_regs, regs, tbuf, &frag_mopt, NULL);
+                                  AlignmentSet mate_alignments[2];
+                                  for (int seg = 0; seg < 2; seg++)
+                                  {
+                                      n_hits += n_regs[seg];
+                                      add_alignments(allele_ids, regs[seg], n_regs[seg], read_ids[i + seg], qlens[seg], max_num_mismatches, mate_alignments[seg]);
+                                  }
+                                  n_improper += add_pair_alignments(mate_alignments[0], mate_alignments[1], batch_alignments[batch]);
+                                  n_pairs++;
+                                  i++;
+                                  continue;
+                              }
+                              int n_reg;
+                              mm_reg1_t *reg = mm_map(mi, read.size(), read.data(), &n_reg, tbuf, &mopt, NULL); // get all hits for the query
+                              n_hits += n_reg;
+                              add_alignments(allele_ids, reg, n_reg, read_ids[i], read.size(), max_num_mismatches, batch_alignments[batch]);
+                          }
+                          mm_tbuf_destroy(tbuf); // deallocate the thread buffer
+                          stats.reads_mapped += batch_end - batch_start;
+                          stats.pairs_mapped += n_pairs;
+                          stats.hits_kept += batch_alignments[batch].size();
+                          stats.hits_improper += n_improper;
+                          stats.hits_rejected += n_hits - n_improper - batch_alignments[batch].size();
+                      });
 
-    mm_idx_reader_close(r); // close the index reader
-    kseq_destroy(ks);       // close the query file
-    gzclose(readsFile);     // close the query file
-    
+    // Merge the batches in read order
+    AlignmentSet alignments;
+    for (auto &batch : batch_alignments)
+        alignments.append(move(batch));
     return alignments;
 }
 
+/* Align the given reads from the read store against an in-memory set of sequences */
+AlignmentSet align_minimap(
+    const IndexSequences &kirdb, const ReadStore &reads, const vector<int> &read_ids, ThreadPool &pool, int max_num_mismatches = 5, IndexStore *indexes = nullptr)
+{
+    mm_idxopt_t iopt;
+    mm_mapopt_t mopt;
+    set_minimap_options(iopt, mopt);
+
+    mm_idx_t *mi = indexes ? indexes->acquire(kirdb, iopt) : build_index(kirdb, iopt); // minimap2 index
+    mm_mapopt_update(&mopt, mi);                                                         // this sets the maximum minimizer occurrence
+    auto alignments = map_reads(mi, mopt, kirdb.allele_ids, reads, read_ids, pool, max_num_mismatches);
+    if (indexes) // deallocate the index
+        indexes->release(mi);
+    else
+        mm_idx_destroy(mi);
+    return alignments;
+}
+
+/* Number of reads held in memory at a time by the streaming first pass, even so that mates stay in the same chunk */
+const int STREAM_CHUNK_SIZE = 1 << 20;
+
+/* First pass that streams the reads file in chunks and only keeps the reads that aligned, and their pairs if requested
+ * With a mates file, reads are paired with its reads and kept_reads is marked as paired */
+AlignmentSet stream_first_pass(
+    const IndexSequences &representatives, const string &reads_file, const string &mates_file, ReadStore &kept_reads, bool inc_pair, ThreadPool &pool, IndexStore *indexes = nullptr, const KmerFilter *prefilter = nullptr, size_t *n_filtered = nullptr, bool dedup = false)
+{
+    mm_idxopt_t iopt;
+    mm_mapopt_t mopt;
+    set_minimap_options(iopt, mopt);
+    mm_idx_t *mi = indexes ? indexes->acquire(representatives, iopt) : build_index(representatives, iopt);
+    mm_mapopt_update(&mopt, mi);
+
+    AlignmentSet first_pass_results;
+    ReadsReader reader(reads_file, mates_file, &pool);
+    kept_reads.paired = kept_reads.paired || reader.paired();
+    bool eof = false;
+    while (!eof)
+    {
+        ReadStore chunk(kept_reads.packed);
+        chunk.paired = kept_reads.paired;
+        while (chunk.size() < STREAM_CHUNK_SIZE && !(eof = !reader.read(chunk)))
+            ;
+        if (dedup && !chunk.paired)
+            chunk.deduplicate();
+
+        // A pair is kept by the prefilter if either mate passes, so that it is still mapped as a fragment
+        vector<int> read_ids = chunk.ids;
+        if (prefilter)
+        {
+            read_ids = prefilter->filter(chunk, chunk.ids, pool);
+            if (chunk.paired)
+                read_ids = with_mates(chunk, read_ids);
+            if (n_filtered)
+                *n_filtered += chunk.ids.size() - read_ids.size();
+        }
+        auto chunk_results = map_reads(mi, mopt, representatives.allele_ids, chunk, read_ids, pool);
+        vector<int> hits;
+        for (const auto &alignment : chunk_results.records)
+        {
+            hits.push_back(alignment.read_id);
+            if (inc_pair && chunk.contains(get_pair_id(alignment.read_id)))
+                hits.push_back(get_pair_id(alignment.read_id));
+        }
+        first_pass_results.append(move(chunk_results));
+
+        // The read store needs IDs in increasing order
+        sort(hits.begin(), hits.end());
+        hits.erase(unique(hits.begin(), hits.end()), hits.end());
+        string buffer;
+        for (int read_id : hits)
+        {
+            string_view read = chunk.get(read_id, buffer);
+            kept_reads.add(read_id, read.data(), read.size());
+        }
+    }
+    if (indexes)
+        indexes->release(mi);
+    else
+        mm_idx_destroy(mi);
+    return first_pass_results;
+}
+
 #endif
\ No newline at end of file
@@ -2,15 +2,21 @@
 #include <fstream>
 #include <iostream>
 #include <mutex>
-#include <queue>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <memory>
+#include <sys/stat.h>
 
 #include "align_thread.hpp"
 #include "cli.hpp"
 #include "helper.hpp"
 #include "kir.hpp"
+#include "pipeline.hpp"
+#include "representatives.hpp"
+#include "server.hpp"
 #include "types.hpp"
+#include "writer.hpp"
 
 using namespace std;
 
@@ -29,6 +35,7 @@ int main(int argc, char const *argv[]) {
         string allele_id = "";
         int read_id = -1;
         int num_results = -1;
+        int n_threads = thread::hardware_concurrency();
         string alignments_file = argv[2];
         for (int i = 3; i < argc; i++)
             if (string(argv[i]) == "--head")
@@ -39,169 +46,259 @@ int main(int argc, char const *argv[]) {
                 kir_id = argv[++i];
             else if (string(argv[i]) == "-a")
                 allele_id = argv[++i];
-        show_report(alignments_file, kir_id, allele_id, read_id, num_results);
-    } else if (command == "align") {
+            else if (string(argv[i]) == "-t")
+                n_threads = stoi(argv[++i]);
+        show_report(alignments_file, kir_id, allele_id, read_id, num_results, n_threads);
+    } else if (command == "index") {
         if (argc < 4)
             return show_help(argv[0]);
 
         // Parse arguments
         string kirs_file = argv[2];
-        string reads_file = argv[3];
-        string method = "regional";
+        string index_cache = argv[3];
         int num_representatives = 1;
-        bool inc_pair = false;
         int n_threads = thread::hardware_concurrency();
-        string output_file = "";
         for (int i = 4; i < argc; i++)
-            if (string(argv[i]) == "--method") {
-                method = argv[++i];
-                if (method != "naive" && method != "regional" && method != "categorical")
-                    return show_help(argv[0]);
-            } else if (string(argv[i]) == "-r")
+            if (string(argv[i]) == "-r")
                 num_representatives = stoi(argv[++i]);
-            else if (string(argv[i]) == "--pair")
-                inc_pair = true;
             else if (string(argv[i]) == "-t")
                 n_threads = stoi(argv[++i]);
-            else if (string(argv[i]) == "-o")
-                output_file = argv[++i];
-        cout << "[+] Using " << n_threads << " thread(s)." << endl;
+        mkdir(index_cache.c_str(), 0755);
 
-        // Load data
         unordered_map<string, unordered_map<string, string>> kirs = load_kirs(kirs_file);
-        unordered_map<int, string> reads = load_reads(reads_file);
-        cout << "[+] Loaded " << reads.size() << " reads." << endl;
+        AlleleDict dict(kirs);
 
-        // Extract reads to fasta file with new indexing
-        cout << "[*] Extracting reads to fasta file with new indexing..." << flush;
-        string reads_fasta_file = reindex_reads(reads);
-        cout << "\r[✓]" << endl;
+        mm_idxopt_t iopt;
+        mm_mapopt_t mopt;
+        set_minimap_options(iopt, mopt);
+        ThreadPool pool(n_threads);
 
-        // Mutex for thread-safe access to all_alignments
-        unordered_map<string, unordered_map<string, vector<ReadAlignment>>> all_alignments;
-        vector<thread> threads;
-        mutex mtx;
-
-        // Atomic variable to track progress
-        atomic<int> progress(0);
-        int total_genes = kirs.size();
-        int bar_width = 70;
-
-        // Function to display progress bar
-        auto display_progress = [&]() {
-            while (progress < total_genes) {
-                float progress_ratio = static_cast<float>(progress) / total_genes;
-                int pos = bar_width * progress_ratio;
-                cout << "\r[";
-                for (int i = 0; i < bar_width; ++i)
-                    cout << (i < pos ? "=" : (i == pos ? ">" : " "));
-                cout << "] " << int(progress_ratio * 100.0) << " %";
-                cout.flush();
-                this_thread::sleep_for(chrono::milliseconds(100));
-            }
-            cout << "\r[";
-            for (int i = 0; i < bar_width; ++i)
-                cout << "=";
-            cout << "] 100 %\n";
+        // Indexes are keyed by their content, so after a database update only those of changed genes are built
+        atomic<int> n_built(0);
+        auto index_if_missing = [&](const IndexSequences &sequences) {
+            if (file_exists(index_cache_path(sequences, iopt, index_cache)))
+                return;
+            mm_idx_destroy(build_index(sequences, iopt, index_cache));
+            n_built++;
         };
 
-        // Perform alignment
-        if (method == "naive") {
-            auto gene_it = kirs.begin();
-            mutex gene_it_mtx;
-            cout << "[*] Performing naive alignment..." << endl;
-            thread progress_thread(display_progress);
-
-            for (int i = 0; i < n_threads; ++i)
-                threads.push_back(thread(naive_align, i, ref(kirs), ref(reads_fasta_file), ref(all_alignments), ref(mtx), ref(gene_it), ref(gene_it_mtx), ref(progress), n_threads));
-
-            // Wait for all threads to finish
-            for (auto &t : threads)
-                t.join();
-
-            // Wait for progress thread to finish
-            progress_thread.join();
-        } else {
-            // Regional and categorical alignment both require a first pass to extract representative alleles
-            cout << "[*] Extracting " << num_representatives << " representative allele(s) per gene..." << flush;
-            string representatives_file = extract_representatives(kirs, num_representatives);
-            cout << "\r[✓]" << endl;
-
-            cout << "[*] Performing initial alignment with representative alleles..." << flush;
-            auto first_pass_results = align_minimap(representatives_file, reads_fasta_file, n_threads);
-            cleanup(representatives_file);
-            cout << "\r[✓]" << endl;
-
-            auto gene_it = first_pass_results.begin();
-            mutex gene_it_mtx;
-
-            cout << "[*] Performing " << method << " alignment on " << total_genes << " gene(s)..." << endl;
-            thread progress_thread(display_progress);
-
-            auto method_func = "regional" ? regional_align : categorical_align;
-            for (int i = 0; i < n_threads; ++i)
-                threads.push_back(thread(method_func, i, ref(kirs), ref(reads), ref(first_pass_results), ref(all_alignments), ref(mtx), ref(gene_it), ref(gene_it_mtx), ref(progress), inc_pair, n_threads));
-
-            // Wait for all threads to finish
-            for (auto &t : threads)
-                t.join();
-
-            // Wait for progress thread to finish
-            progress_thread.join();
+        cout << "[*] Indexing representative alleles..." << flush;
+        index_if_missing(extract_representatives(dict, kirs, num_representatives, pool, kirs_file + ".representatives"));
+        cout << "\r[✓]" << endl;
+
+        cout << "[*] Indexing " << kirs.size() << " gene(s)..." << flush;
+        vector<IndexSequences> chunks;
+        for (const auto &gene : kirs)
+            for (auto &alleles : AlleleClasses(gene_sequences(dict, gene.first, gene.second)).chunks())
+                chunks.push_back(move(alleles));
+        pool.parallel_for(chunks.size(), [&](int i) { index_if_missing(chunks[i]); });
+        cout << "\r[✓]" << endl;
+
+        cout << "[+] Built " << n_built << " of " << chunks.size() + 1 << " indexes, the others were already in " << index_cache << endl;
+    } else if (command == "align") {
+        if (argc < 4)
+            return show_help(argv[0]);
+
+        // Parse arguments
+        string kirs_file = argv[2];
+        SampleFiles sample;
+        sample.reads_file = argv[3];
+        sample.mates_file = argc > 4 && argv[4][0] != '-' ? argv[4] : "";
+        AlignOptions options;
+        string stats_file = "";
+        for (int i = sample.mates_file.empty() ? 4 : 5; i < argc; i++) {
+            int parsed = parse_align_option(argv, i, options);
+            if (parsed < 0)
+                return show_help(argv[0]);
+            else if (parsed)
+                continue;
+            else if (string(argv[i]) == "-o")
+                sample.output_file = argv[++i];
+            else if (string(argv[i]) == "--genotype")
+                sample.genotype_file = argv[++i];
+            else if (string(argv[i]) == "--update")
+                sample.previous_file = argv[++i];
+            else if (string(argv[i]) == "--checkpoint")
+                sample.checkpoint_dir = argv[++i];
+            else if (string(argv[i]) == "--resume")
+                options.resume = true;
+            else if (string(argv[i]) == "--stats")
+                stats_file = argv[++i];
+        }
+        if (options.resume && sample.checkpoint_dir.empty()) {
+            cerr << "[x] --resume needs the --checkpoint directory of the run to resume" << endl;
+            return 1;
+        }
+        if (!options.index_cache.empty())
+            mkdir(options.index_cache.c_str(), 0755);
+        cout << "[+] Using " << options.n_threads << " thread(s)." << endl;
+        // One pool for index building, mapping and the per-gene tasks, so nested work never exceeds n_threads
+        ThreadPool pool(options.n_threads);
+
+        AlignmentContext context(kirs_file, options, pool, false, cout);
+        size_t records_written = align_sample(context, options, sample, pool, cout, true);
+        if (!sample.output_file.empty())
+            cout << "[+] " << records_written << " alignments saved to " << sample.output_file << endl;
+        if (!stats_file.empty()) {
+            stats.save(stats_file);
+            cout << "[+] Stats saved to " << stats_file << endl;
+        }
+    } else if (command == "align-batch") {
+        if (argc < 4)
+            return show_help(argv[0]);
+
+        // Parse arguments
+        string kirs_file = argv[2];
+        string manifest_file = argv[3];
+        AlignOptions options;
+        int max_samples = 2;
+        bool genotype = false;
+        bool update = false;
+        string checkpoint_dir = "";
+        string stats_file = "";
+        for (int i = 4; i < argc; i++) {
+            int parsed = parse_align_option(argv, i, options);
+            if (parsed < 0)
+                return show_help(argv[0]);
+            else if (parsed)
+                continue;
+            else if (string(argv[i]) == "--max-samples")
+                max_samples = max(stoi(argv[++i]), 1);
+            else if (string(argv[i]) == "--genotype")
+                genotype = true;
+            else if (string(argv[i]) == "--update")
+                update = true;
+            else if (string(argv[i]) == "--checkpoint")
+                checkpoint_dir = argv[++i];
+            else if (string(argv[i]) == "--resume")
+                options.resume = true;
+            else if (string(argv[i]) == "--stats")
+                stats_file = argv[++i];
+        }
+        if (genotype && update) {
+            cerr << "[x] --update needs the alignments in the output files, it can't be used with --genotype" << endl;
+            return 1;
         }
+        if (options.resume && checkpoint_dir.empty()) {
+            cerr << "[x] --resume needs the --checkpoint directory of the batch to resume" << endl;
+            return 1;
+        }
+        if (!checkpoint_dir.empty())
+            mkdir(checkpoint_dir.c_str(), 0755);
+        if (!options.index_cache.empty())
+            mkdir(options.index_cache.c_str(), 0755);
 
-        // Cleanup intermediate files
-        cleanup(reads_fasta_file);
-
-        // Sort result lines by adding them to a heap first
-        // uint total_matches = 0;
-        // priority_queue<string, vector<string>, greater<string>> results;  // min heap
-        // for (const auto &gene : all_alignments) {
-        //     uint total = 0;
-        //     for (const auto &allele : gene.second)
-        //         total += allele.second.size();
-        //     total_matches += total;
-        //     results.push(gene.first + ":" + string(10 - gene.first.size(), ' ') + to_string(total) + " matches found in " + to_string(gene.second.size()) + " alleles");
-        // }
-
-        // // Report results
-        // cout << "\n[+] Results:" << endl;
-        // while (!results.empty()) {
-        //     cout << results.top() << endl;
-        //     results.pop();
-        // }
-        // cout << "[+] Total matches: " << total_matches << endl;
-
-        if (!output_file.empty()) {
-            ofstream out_file(output_file);
-            expect(out_file.is_open(), "[-] Error: Unable to open file " + output_file + " for writing.");
-            
-            // Use a buffer to accumulate the output
-            string buffer;
-            const size_t buffer_size = 100 * 1024 * 1024; // 100 MB buffer size
-            for (const auto &gene : all_alignments) {
-                for (const auto &allele : gene.second) {
-                    for (const auto &alignment : allele.second) {
-                        buffer.append(to_string(alignment.read_id) + "\t" + alignment.kir_id + "\t" + alignment.allele_id + "\t" + (alignment.reversed ? "1" : "0") + "\t" + to_string(alignment.cost) + "\t" + to_string(alignment.read_start) + "\t" + to_string(alignment.read_end) + "\t" + to_string(alignment.query_start) + "\t" + to_string(alignment.query_end) + "\t" + alignment.cigar + "\n");
-                        
-                        // Write buffer to file if it exceeds the buffer size
-                        if (buffer.size() >= buffer_size) {
-                            out_file << buffer;
-                            buffer.clear();
-                        }
-                    }
-                }    
+        // Manifest lines are `<reads_file> [<mates_file>] <output_file>`, blank lines and lines starting with `#` are skipped
+        // With --genotype, the output file gets the genotype instead of the alignments, and with --update it is updated in place
+        vector<SampleFiles> samples;
+        ifstream manifest(manifest_file);
+        if (!manifest) {
+            cerr << "[x] Failed to open manifest " << manifest_file << endl;
+            return 1;
+        }
+        string line;
+        while (getline(manifest, line)) {
+            stringstream fields(line);
+            vector<string> columns;
+            for (string column; fields >> column;)
+                columns.push_back(column);
+            if (columns.empty() || line[0] == '#')
+                continue;
+            if (columns.size() == 1 || columns.size() > 3) {
+                cerr << "[x] Expected `<reads_file> [<mates_file>] <output_file>` in " << manifest_file << ": " << line << endl;
+                return 1;
+            }
+            SampleFiles sample;
+            sample.reads_file = columns[0];
+            sample.mates_file = columns.size() == 3 ? columns[1] : "";
+            if (genotype)
+                sample.genotype_file = columns.back();
+            else
+                sample.output_file = columns.back();
+            if (update)
+                sample.previous_file = sample.output_file;
+            if (!checkpoint_dir.empty()) { // one directory per sample, named after its reads and output
+                string name = sample.reads_file + '\t' + columns.back();
+                char id[32];
+                snprintf(id, sizeof(id), "%016llx", (unsigned long long)fnv1a(name.c_str(), name.size()));
+                sample.checkpoint_dir = checkpoint_dir + "/" + id;
             }
-            
-            // Write any remaining data in the buffer to the file
-            if (!buffer.empty()) {
-                out_file << buffer;
+            samples.push_back(sample);
+        }
+        cout << "[+] Using " << options.n_threads << " thread(s) for " << samples.size() << " sample(s), at most " << max_samples << " at a time." << endl;
+        ThreadPool pool(options.n_threads);
+
+        // The database, representatives and indexes are loaded once for all samples
+        AlignmentContext context(kirs_file, options, pool, true, cout);
+        context.preload(options.method != "naive" ? options.num_representatives : 0, options.method != "regional", pool, cout);
+
+        // Each lane aligns every max_samples-th sample, so at most max_samples samples hold their reads in memory
+        ostream quiet(nullptr);
+        mutex log_mtx;
+        atomic<int> n_failed(0);
+        int n_lanes = min<int>(max_samples, samples.size());
+        pool.parallel_for(n_lanes, [&](int lane) {
+            for (size_t i = lane; i < samples.size(); i += n_lanes) {
+                const SampleFiles &sample = samples[i];
+                try {
+                    size_t records_written = align_sample(context, options, sample, pool, quiet, false);
+                    lock_guard<mutex> lock(log_mtx);
+                    if (genotype)
+                        cout << "[+] " << sample.reads_file << ": genotype saved to " << sample.genotype_file << endl;
+                    else
+                        cout << "[+] " << sample.reads_file << ": " << records_written << " alignments saved to " << sample.output_file << endl;
+                } catch (const exception &e) {
+                    n_failed++;
+                    lock_guard<mutex> lock(log_mtx);
+                    cerr << "[x] " << sample.reads_file << ": " << e.what() << endl;
+                }
             }
-            out_file.close();
-            
-            cout << "[+] Results saved to " << output_file << endl;
+        });
+        cout << "[+] Aligned " << samples.size() - n_failed << " of " << samples.size() << " sample(s)." << endl;
+        if (!stats_file.empty()) {
+            stats.save(stats_file);
+            cout << "[+] Stats saved to " << stats_file << endl;
+        }
+        if (n_failed)
+            return 1;
+    } else if (command == "serve") {
+        if (argc < 4)
+            return show_help(argv[0]);
+
+        // Parse arguments, the align options given here are the defaults of every job
+        string kirs_file = argv[2];
+        string socket_path = argv[3];
+        AlignOptions options;
+        int max_jobs = 2;
+        for (int i = 4; i < argc; i++) {
+            int parsed = parse_align_option(argv, i, options);
+            if (parsed < 0)
+                return show_help(argv[0]);
+            else if (parsed)
+                continue;
+            else if (string(argv[i]) == "--max-jobs")
+                max_jobs = max(stoi(argv[++i]), 1);
         }
+        if (!options.index_cache.empty())
+            mkdir(options.index_cache.c_str(), 0755);
 
+        // The serving thread only accepts requests, so the pool gets one more thread for all n_threads to run jobs
+        cout << "[+] Using " << options.n_threads << " thread(s), at most " << max_jobs << " job(s) at a time." << endl;
+        ThreadPool pool(options.n_threads + 1);
+
+        // Jobs may pick any method, so the representatives and the gene indexes are all loaded up front
+        AlignmentContext context(kirs_file, options, pool, true, cout);
+        context.preload(options.num_representatives, true, pool, cout);
+
+        AlignmentServer server(context, options, pool, max_jobs);
+        server.serve(socket_path);
+    } else if (command == "request") {
+        if (argc < 4)
+            return show_help(argv[0]);
+        string request = argv[3];
+        for (int i = 4; i < argc; i++)
+            request += string(" ") + argv[i];
+        return send_request(argv[2], request);
     } else
         return show_help(argv[0]);
 
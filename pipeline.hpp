@@ -0,0 +1,560 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <mutex>
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <sys/stat.h>
+
+#include "helper.hpp"
+#include "alignment.hpp"
+#include "align_thread.hpp"
+#include "checkpoint.hpp"
+#include "genotype.hpp"
+#include "kir.hpp"
+#include "prefilter.hpp"
+#include "representatives.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "update.hpp"
+#include "writer.hpp"
+
+using namespace std;
+
+/* Options of the align command, the same for every sample of a batch */
+struct AlignOptions
+{
+    string method = "regional";
+    int num_representatives = 1;
+    bool inc_pair = false;
+    int n_threads = thread::hardware_concurrency();
+    string index_cache = "";
+    bool stream = false;
+    bool pack_reads = false;
+    int prefilter_min_kmers = 0;
+    bool dedup = false;
+    bool resume = false; // resume from the checkpoint of a sample, if it has one
+};
+
+/* Parse an option of the align command at argv[i] that applies to every sample
+ * Returns 1 if it was one, 0 if it wasn't, and -1 if its value is invalid */
+int parse_align_option(char const *argv[], int &i, AlignOptions &options)
+{
+    string option = argv[i];
+    if (option == "--method")
+    {
+        options.method = argv[++i];
+        if (options.method != "naive" && options.method != "regional" && options.method != "categorical")
+            return -1;
+    }
+    else if (option == "-r")
+        options.num_representatives = stoi(argv[++i]);
+    else if (option == "--pair")
+        options.inc_pair = true;
+    else if (option == "-t")
+        options.n_threads = stoi(argv[++i]);
+    else if (option == "--cache")
+        options.index_cache = argv[++i];
+    else if (option == "--stream")
+        options.stream = true;
+    else if (option == "--pack-reads")
+        options.pack_reads = true;
+    else if (option == "--prefilter")
+        options.prefilter_min_kmers = stoi(argv[++i]);
+    else if (option == "--dedup")
+        options.dedup = true;
+    else
+        return 0;
+    return 1;
+}
+
+/* What every sample aligned against a database shares: the alleles, the representatives, the prefilter and the indexes */
+class AlignmentContext
+{
+public:
+    unordered_map<string, unordered_map<string, string>> kirs;
+    AlleleDict dict;
+    unique_ptr<KmerFilter> prefilter;
+    IndexStore indexes;
+    vector<uint64_t> gene_hashes; // content hash of each gene, by gene ID
+    vector<int> allele_lengths;   // length of each allele, by allele ID
+
+    /* With resident indexes, every index is built or loaded once and kept for all samples */
+    AlignmentContext(const string &kirs_file, const AlignOptions &options, ThreadPool &pool, bool resident, ostream &log)
+        : indexes(options.index_cache, resident), kirs_file(kirs_file)
+    {
+        kirs = timed("load_kirs", [&]()
+                     { return load_kirs(kirs_file); });
+        dict = AlleleDict(kirs);
+        gene_hashes = ::gene_hashes(dict, kirs);
+        for (size_t allele_id = 0; allele_id < dict.alleles.size(); allele_id++)
+            allele_lengths.push_back(kirs.at(dict.gene(allele_id)).at(dict.alleles[allele_id]).size());
+
+        if (options.prefilter_min_kmers > 0)
+        {
+            log << "[*] Building k-mer prefilter..." << flush;
+            prefilter = timed("build_prefilter", [&]()
+                              { return make_unique<KmerFilter>(kirs, options.prefilter_min_kmers); });
+            log << "\r[✓]" << endl;
+        }
+
+        // Regional and categorical alignment both require a first pass to extract representative alleles
+        if (options.method != "naive")
+        {
+            log << "[*] Extracting " << options.num_representatives << " representative allele(s) per gene..." << flush;
+            representatives(options.num_representatives, pool);
+            log << "\r[✓]" << endl;
+        }
+    }
+
+    /* The representative alleles for a given -r, extracted on first use
+     * The lock is not held while extracting, as the pool may run another sample's task on this thread meanwhile */
+    const IndexSequences &representatives(int num_representatives, ThreadPool &pool)
+    {
+        {
+            lock_guard<mutex> lock(representatives_mtx);
+            auto it = representatives_by_count.find(num_representatives);
+            if (it != representatives_by_count.end())
+                return it->second;
+        }
+        IndexSequences extracted = timed("extract_representatives", [&]()
+                                         { return extract_representatives(dict, kirs, num_representatives, pool, kirs_file + ".representatives"); });
+        lock_guard<mutex> lock(representatives_mtx);
+        return representatives_by_count.emplace(num_representatives, move(extracted)).first->second; // keeps the first if extracted twice
+    }
+
+    /* Load the indexes that don't depend on the reads ahead of time: the representatives for -r num_representatives
+     * if it is positive, and the allele chunks of each gene if with_genes */
+    void preload(int num_representatives, bool with_genes, ThreadPool &pool, ostream &log)
+    {
+        log << "[*] Loading indexes..." << flush;
+        vector<IndexSequences> sequences;
+        if (num_representatives > 0)
+            sequences.push_back(representatives(num_representatives, pool));
+        if (with_genes)
+            for (const auto &gene : dict.genes)
+                for (auto &alleles : AlleleClasses(gene_sequences(dict, gene, kirs.at(gene))).chunks())
+                    sequences.push_back(move(alleles));
+        mm_idxopt_t iopt;
+        mm_mapopt_t mopt;
+        set_minimap_options(iopt, mopt);
+        pool.parallel_for(sequences.size(), [&](int i)
+                          { indexes.acquire(sequences[i], iopt); });
+        log << "\r[✓]" << endl;
+    }
+
+private:
+    string kirs_file;
+    mutex representatives_mtx;
+    map<int, IndexSequences> representatives_by_count;
+};
+
+/* The files of one sample, the mates file and either output file may be empty */
+struct SampleFiles
+{
+    string reads_file;
+    string mates_file;    // mates of the reads in reads_file, in the same order
+    string output_file;   // alignments
+    string genotype_file; // allele calls of each gene
+    string previous_file; // alignments of a previous run to update, may be output_file itself
+    string checkpoint_dir; // where progress is saved to resume the sample after a crash
+};
+
+/* Key of a sample's run, from the reads files (by path, size and modification time), the options that change the
+ * alignments and the content of the database, so that a checkpoint is only resumed by the run that wrote it */
+uint64_t run_key(const AlignOptions &options, const SampleFiles &sample, const vector<uint64_t> &gene_hashes)
+{
+    uint64_t key = fnv1a(options.method.c_str(), options.method.size() + 1);
+    for (const string &file : {sample.reads_file, sample.mates_file})
+    {
+        struct stat info = {};
+        stat(file.c_str(), &info);
+        int64_t size = info.st_size, mtime = info.st_mtime;
+        key = fnv1a(file.c_str(), file.size() + 1, key);
+        key = fnv1a(&size, sizeof(size), key);
+        key = fnv1a(&mtime, sizeof(mtime), key);
+    }
+    // Streaming keeps the reads of the first pass in the checkpoint, which a run loading every read must not add again
+    bool stream = options.stream && options.method != "naive";
+    int values[] = {options.num_representatives, options.inc_pair, options.prefilter_min_kmers, options.dedup, stream};
+    key = fnv1a(values, sizeof(values), key);
+    return fnv1a(gene_hashes.data(), gene_hashes.size() * sizeof(uint64_t), key);
+}
+
+/* Align the reads of one sample and write the alignments and the genotype, returns the number of alignments written
+ * Progress is reported to log, and a progress bar is shown with show_progress */
+size_t align_sample(AlignmentContext &context, const AlignOptions &options, const SampleFiles &sample, ThreadPool &pool, ostream &log, bool show_progress)
+{
+    const string &reads_file = sample.reads_file, &mates_file = sample.mates_file, &output_file = sample.output_file;
+    const auto &kirs = context.kirs;
+    const AlleleDict &dict = context.dict;
+    const KmerFilter *prefilter = context.prefilter.get();
+    const string &method = options.method;
+
+    // With a previous output, only the genes whose alleles changed since are aligned again, the others are copied over
+    vector<char> realign(dict.genes.size(), 1), splice(dict.genes.size(), 0);
+    unique_ptr<PreviousAlignments> previous;
+    if (!sample.previous_file.empty())
+    {
+        OutputFormat previous_format = output_format(sample.previous_file);
+        expect(previous_format == OutputFormat::TSV || previous_format == OutputFormat::KAB, "[x] Only TSV and .kab alignments can be updated, not " + sample.previous_file);
+        previous = make_unique<PreviousAlignments>(sample.previous_file, dict);
+        GeneManifest manifest = GeneManifest::load(sample.previous_file);
+        for (size_t gene_id = 0; gene_id < dict.genes.size(); gene_id++)
+        {
+            auto it = manifest.genes.find(dict.genes[gene_id]);
+            if (it != manifest.genes.end() && it->second.first == context.gene_hashes[gene_id])
+            {
+                realign[gene_id] = 0;
+                splice[gene_id] = it->second.second > 0;
+            }
+        }
+        log << "[+] " << count(realign.begin(), realign.end(), 1) << " of " << dict.genes.size() << " gene(s) changed since " << sample.previous_file << "." << endl;
+    }
+
+    // Genes finished by an interrupted run of the sample are taken from its checkpoint rather than aligned again
+    unique_ptr<Checkpoint> checkpoint;
+    vector<char> resumed(dict.genes.size(), 0);
+    if (!sample.checkpoint_dir.empty())
+    {
+        checkpoint = make_unique<Checkpoint>(sample.checkpoint_dir, run_key(options, sample, context.gene_hashes), options.resume, log);
+        for (size_t gene_id = 0; gene_id < dict.genes.size(); gene_id++)
+            if (checkpoint->is_done(gene_id))
+            {
+                resumed[gene_id] = 1;
+                realign[gene_id] = splice[gene_id] = 0;
+            }
+    }
+    bool align_any = count(realign.begin(), realign.end(), 1) > 0;
+
+    // Mates from separate files are mapped as one fragment and follow each other into the second pass. Their mates are
+    // needed to map them, so paired reads are not deduplicated. Interleaved reads with --pair are still mapped one by
+    // one, their mates only follow them into the second pass.
+    bool paired = !mates_file.empty();
+    bool inc_pair = options.inc_pair || paired;
+    bool dedup = options.dedup && !paired;
+    if (options.dedup && paired)
+        log << "[+] Paired reads are not deduplicated, ignoring --dedup." << endl;
+
+    // The naive method aligns every read to every gene, so it always needs all reads in memory
+    // PAF, SAM and BAM take the read lengths and sequences from the reads, which are loaded even if no gene is aligned
+    bool stream = options.stream && method != "naive";
+    bool needs_reads = AlignmentFormatter::needs_reads(output_format(output_file)) && !output_file.empty();
+    ReadStore reads(options.pack_reads);
+    reads.paired = paired;
+    if ((!stream && align_any) || (!align_any && needs_reads))
+    {
+        reads = timed("load_reads", [&]()
+                      { return load_reads(reads_file, options.pack_reads, mates_file, &pool); }, reads_file);
+        reads.paired = paired;
+        log << "[+] Loaded " << reads.size() << " reads" << (mates_file.empty() ? "" : " in pairs") << "." << endl;
+        if (dedup)
+            log << "[+] Found " << timed("deduplicate", [&]()
+                                         { return reads.deduplicate(); }, reads_file)
+                << " distinct read sequences." << endl;
+    }
+
+    // Drop reads that share too few k-mers with the database before any mapping
+    vector<int> read_ids = reads.ids;
+    if (prefilter && !stream && align_any)
+    {
+        read_ids = timed("prefilter", [&]()
+                         { return prefilter->filter(reads, reads.ids, pool); }, reads_file);
+        if (paired) // a pair is kept if either mate passes, so that it is still mapped as a fragment
+            read_ids = with_mates(reads, read_ids);
+        stats.reads_filtered += reads.size() - read_ids.size();
+        log << "[+] Prefilter dropped " << reads.size() - read_ids.size() << " of " << reads.size() << " reads." << endl;
+    }
+
+    // Genes are written out and genotyped as soon as they are done, while the other genes are still being aligned.
+    // An output that is also the previous one is written next to it and replaces it once done.
+    unique_ptr<AlignmentWriter> writer;
+    unique_ptr<Genotyper> genotyper;
+    if (!sample.genotype_file.empty())
+        genotyper = make_unique<Genotyper>(dict, paired);
+    string write_file = output_file;
+    if (!output_file.empty() && output_file == sample.previous_file)
+    {
+        size_t name = output_file.rfind('/') + 1; // keeps the extension, which sets the format
+        write_file = output_file.substr(0, name) + ".update." + output_file.substr(name);
+    }
+    vector<size_t> gene_alignments(dict.genes.size(), 0);
+    auto finish_gene = [&](int gene_id, AlignmentSet &&alignments)
+    {
+        gene_alignments[gene_id] = alignments.size();
+        if (genotyper)
+            genotyper->add(gene_id, alignments);
+        writer->add(gene_id, move(alignments));
+    };
+    auto finish_aligned_gene = [&](int gene_id, AlignmentSet &&alignments)
+    {
+        if (checkpoint)
+            checkpoint->save_gene(gene_id, alignments);
+        finish_gene(gene_id, move(alignments));
+    };
+    auto splice_previous = [&]()
+    {
+        if (count(resumed.begin(), resumed.end(), 1))
+            timed("resume", [&]()
+                  { checkpoint->for_each_done_gene(finish_gene); return 0; }, reads_file);
+        if (count(splice.begin(), splice.end(), 1) == 0)
+            return;
+        timed("splice", [&]()
+              {
+                  vector<char> spliced(dict.genes.size(), 0);
+                  previous->for_each_gene(splice, [&](int gene_id, AlignmentSet &&alignments)
+                                                                               {
+                                                                                   spliced[gene_id] = 1;
+                                                                                   finish_gene(gene_id, move(alignments));
+                                                                               });
+                  for (size_t gene_id = 0; gene_id < dict.genes.size(); gene_id++) // the writer waits for every gene
+                      if (splice[gene_id] && !spliced[gene_id])
+                          finish_gene(gene_id, AlignmentSet());
+                  return 0;
+              },
+              sample.previous_file);
+    };
+    auto with_spliced = [&](vector<int> gene_order)
+    {
+        for (size_t gene_id = 0; gene_id < dict.genes.size(); gene_id++)
+            if (splice[gene_id] || resumed[gene_id])
+                gene_order.push_back(gene_id);
+        sort(gene_order.begin(), gene_order.end());
+        return gene_order;
+    };
+    TaskGroup genes;
+
+    // Atomic variable to track progress
+    atomic<int> progress(0);
+    int total_genes = kirs.size();
+    int bar_width = 70;
+
+    // Function to display progress bar, with the mapping throughput and the time left at the current gene rate
+    auto display_progress = [&]()
+    {
+        double start_time = wall_seconds();
+        uint64_t start_reads = stats.reads_mapped;
+        while (progress < total_genes)
+        {
+            float progress_ratio = static_cast<float>(progress) / total_genes;
+            int pos = bar_width * progress_ratio;
+            double elapsed = max(wall_seconds() - start_time, 1e-3);
+            cout << "\r[";
+            for (int i = 0; i < bar_width; ++i)
+                cout << (i < pos ? "=" : (i == pos ? ">" : " "));
+            cout << "] " << int(progress_ratio * 100.0) << " % " << uint64_t((stats.reads_mapped - start_reads) / elapsed) << " reads/s";
+            if (progress > 0)
+            {
+                int eta = elapsed * (total_genes - progress) / progress;
+                cout << " ETA " << eta / 60 << "m" << (eta % 60 < 10 ? "0" : "") << eta % 60 << "s";
+            }
+            cout << "      ";
+            cout.flush();
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        cout << "\r[";
+        for (int i = 0; i < bar_width; ++i)
+            cout << "=";
+        cout << "] 100 %                                        \n";
+    };
+    thread progress_thread;
+
+    // The gene tasks use these until they are all done, after the branches below
+    AlignmentSet first_pass_results;
+    unique_ptr<StageTimer> pass_timer;
+    vector<pair<int, function<void()>>> gene_tasks; // by gene ID, in gene ID order
+
+    // Perform alignment
+    if (method == "naive")
+    {
+        vector<int> gene_order;
+        for (int gene_id = 0; gene_id < (int)dict.genes.size(); gene_id++)
+            if (realign[gene_id])
+                gene_order.push_back(gene_id);
+        total_genes = gene_order.size();
+        writer = make_unique<AlignmentWriter>(write_file, dict, with_spliced(gene_order), pool, context.allele_lengths, &reads);
+
+        log << "[*] Performing naive alignment..." << endl;
+        if (show_progress)
+            progress_thread = thread(display_progress);
+        pass_timer = make_unique<StageTimer>("naive", reads_file);
+
+        for (int gene_id : gene_order)
+            gene_tasks.push_back({gene_id, [&, gene_id]()
+                                  {
+                                      // Each thread collects its own alignments of the gene, merged in a deterministic order once the gene is done
+                                      AlignmentSink sink(pool);
+                                      {
+                                          StageTimer timer("naive.gene", dict.genes[gene_id], false);
+                                          naive_align(kirs, dict, reads, read_ids, dict.genes[gene_id], sink, pool, context.indexes);
+                                      }
+                                      finish_aligned_gene(gene_id, sink.merge());
+                                      progress++;
+                                  }});
+
+    }
+    else
+    {
+        const IndexSequences &representatives = context.representatives(options.num_representatives, pool);
+        bool resume_first_pass = checkpoint && checkpoint->has_first_pass() && align_any;
+        size_t n_filtered = 0; // by the prefilter while streaming, for this sample only
+        if (resume_first_pass)
+            first_pass_results = timed("resume", [&]()
+                                       { return checkpoint->load_first_pass(reads); }, reads_file);
+        else
+        {
+            log << "[*] Performing initial alignment with representative alleles..." << flush;
+            first_pass_results = timed("first_pass", [&]()
+                                       {
+                                           if (!align_any)
+                                               return AlignmentSet();
+                                           if (stream)
+                                               return stream_first_pass(representatives, reads_file, mates_file, reads, inc_pair, pool, &context.indexes, prefilter, &n_filtered, dedup);
+                                           return align_minimap(representatives, reads, read_ids, pool, 5, &context.indexes);
+                                       },
+                                       reads_file);
+            log << "\r[✓]" << endl;
+            if (checkpoint && align_any)
+                checkpoint->save_first_pass(first_pass_results, stream ? &reads : nullptr);
+        }
+        if (stream && prefilter && !resume_first_pass)
+        {
+            stats.reads_filtered += n_filtered;
+            log << "[+] Prefilter dropped " << n_filtered << " reads." << endl;
+        }
+        if (stream)
+            log << "[+] Kept " << reads.size() << " reads that aligned in the first pass." << endl;
+        if (stream && dedup)
+            log << "[+] Found " << reads.deduplicate() << " distinct read sequences." << endl;
+
+        // Group the first pass results by gene, only the genes to align again are kept
+        first_pass_results.sort();
+        vector<pair<size_t, size_t>> gene_ranges;
+        vector<int> gene_order;
+        for (const auto &gene_range : first_pass_results.gene_ranges(dict))
+        {
+            int gene_id = dict.allele_gene[first_pass_results.records[gene_range.first].allele_id];
+            if (!realign[gene_id])
+                continue;
+            gene_ranges.push_back(gene_range);
+            gene_order.push_back(gene_id);
+        }
+        total_genes = gene_ranges.size();
+        writer = make_unique<AlignmentWriter>(write_file, dict, with_spliced(gene_order), pool, context.allele_lengths, &reads);
+
+        log << "[*] Performing " << method << " alignment on " << total_genes << " gene(s)..." << endl;
+        if (show_progress)
+            progress_thread = thread(display_progress);
+        pass_timer = make_unique<StageTimer>("second_pass", reads_file);
+
+        // Each gene splits into (gene, region) or (gene, allele chunk) tasks that idle workers steal
+        for (size_t i = 0; i < gene_ranges.size(); i++)
+            gene_tasks.push_back({gene_order[i], [&, gene_range = gene_ranges[i]]()
+                                  {
+                                      // Each thread collects its own alignments of the gene, merged in a deterministic order once the gene is done
+                                      AlignmentSink sink(pool);
+                                      {
+                                          StageTimer timer("second_pass.gene", dict.gene(first_pass_results.records[gene_range.first].allele_id), false);
+                                          if (method == "regional")
+                                              regional_align(kirs, dict, reads, first_pass_results, gene_range, sink, pool, inc_pair);
+                                          else
+                                              categorical_align(kirs, dict, reads, first_pass_results, gene_range, sink, pool, inc_pair, context.indexes);
+                                      }
+                                      finish_aligned_gene(dict.allele_gene[first_pass_results.records[gene_range.first].allele_id], sink.merge());
+                                      progress++;
+                                  }});
+
+    }
+
+    // Wait for all genes to finish. On a failure the tasks are still drained and the threads stopped before unwinding,
+    // as the tasks use this stack and the writer would otherwise wait for genes that never come.
+    exception_ptr error;
+    try
+    {
+        splice_previous();
+        // A gene only starts once it is within the writer's window, so a slow gene doesn't leave the rest of the output
+        // waiting in memory. Until then this thread runs queued genes itself. A failed gene stops the writer, which then
+        // no longer holds anything back.
+        for (auto &task : gene_tasks)
+        {
+            while (!writer->has_room(task.first))
+                if (!pool.help(genes))
+                    writer->wait_for_room(task.first);
+            pool.submit(genes, [&, run = move(task.second)]()
+                        {
+                            try
+                            {
+                                run();
+                            }
+                            catch (...)
+                            {
+                                writer->stop();
+                                throw;
+                            }
+                        });
+        }
+    }
+    catch (...)
+    {
+        error = current_exception();
+    }
+    try
+    {
+        pool.wait(genes);
+    }
+    catch (...)
+    {
+        if (!error)
+            error = current_exception();
+    }
+    pass_timer.reset();
+    if (error)
+        progress = total_genes;
+    if (progress_thread.joinable())
+        progress_thread.join();
+    if (error)
+    {
+        if (writer)
+            writer->abort();
+        rethrow_exception(error);
+    }
+
+    timed("write", [&]()
+          { writer->finish(); return 0; }, reads_file);
+    stats.bytes_written += writer->bytes_written;
+    if (write_file != output_file)
+    {
+        expect(rename(write_file.c_str(), output_file.c_str()) == 0, "[x] Failed to replace " + output_file);
+        if (file_exists(write_file + ".idx"))
+            expect(rename((write_file + ".idx").c_str(), (output_file + ".idx").c_str()) == 0, "[x] Failed to replace " + output_file + ".idx");
+    }
+    if (!output_file.empty())
+    {
+        GeneManifest manifest;
+        for (size_t gene_id = 0; gene_id < dict.genes.size(); gene_id++)
+            manifest.genes[dict.genes[gene_id]] = {context.gene_hashes[gene_id], gene_alignments[gene_id]};
+        manifest.save(output_file);
+    }
+    if (genotyper)
+    {
+        genotyper->save(sample.genotype_file);
+        log << "[+] Genotype of " << genotyper->n_genes() << " gene(s) saved to " << sample.genotype_file << endl;
+    }
+    if (checkpoint)
+    {
+        checkpoint->remove_files();
+        log << "[+] Run complete, removed checkpoint " << sample.checkpoint_dir << endl;
+    }
+    return writer->records_written;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <algorithm>
+
+#include "read_store.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+
+/* Bloom filter over the canonical k-mers of all alleles, used to drop reads that cannot be KIR before mapping them
+ * One filter is shared by every sample aligned against the database, so it keeps no counts of its own */
+struct KmerFilter
+{
+    static const int K = 21; // k-mer size, 2 bits per base
+
+    int min_shared;             // reads sharing fewer k-mers with the database are dropped
+    uint64_t mask;              // number of bits in the filter - 1, a power of two
+    vector<uint64_t> bits;
+
+    KmerFilter(const unordered_map<string, unordered_map<string, string>> &kirs, int min_shared) : min_shared(min_shared)
+    {
+        // 16 bits per database base keeps false positives well under 1% with 3 hashes, alleles overlap heavily so this is generous
+        size_t total_bases = 0;
+        for (const auto &gene : kirs)
+            for (const auto &allele : gene.second)
+                total_bases += allele.second.size();
+        uint64_t n_bits = 64;
+        while (n_bits < total_bases * 16)
+            n_bits <<= 1;
+        mask = n_bits - 1;
+        bits.assign(n_bits / 64, 0);
+
+        for (const auto &gene : kirs)
+            for (const auto &allele : gene.second)
+                for_each_kmer(allele.second, [&](uint64_t kmer)
+                              {
+                                  for_each_bit(kmer, [&](uint64_t bit)
+                                               { bits[bit >> 6] |= 1ULL << (bit & 63); });
+                                  return true;
+                              });
+    }
+
+    /* Call f on the canonical 2-bit encoding of each k-mer of seq, k-mers spanning non-ACGT bases are skipped
+     * f returns false to stop early */
+    template <typename F>
+    static void for_each_kmer(string_view seq, F f)
+    {
+        const uint64_t kmer_mask = (1ULL << (2 * K)) - 1;
+        const int shift = 2 * (K - 1);
+        uint64_t fwd = 0, rev = 0;
+        int len = 0;
+        for (char c : seq)
+        {
+            uint64_t code;
+            switch (c)
+            {
+            case 'A': case 'a': code = 0; break;
+            case 'C': case 'c': code = 1; break;
+            case 'G': case 'g': code = 2; break;
+            case 'T': case 't': code = 3; break;
+            default:
+                len = 0;
+                continue;
+            }
+            fwd = ((fwd << 2) | code) & kmer_mask;
+            rev = (rev >> 2) | ((3 - code) << shift);
+            if (++len >= K && !f(fwd < rev ? fwd : rev))
+                return;
+        }
+    }
+
+    /* Call f on each of the filter bits of a k-mer */
+    template <typename F>
+    void for_each_bit(uint64_t kmer, F f) const
+    {
+        // splitmix64 finalizer, then double hashing for the 3 bit positions
+        uint64_t h = kmer + 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        uint64_t step = (h >> 32) | 1;
+        for (int i = 0; i < 3; i++)
+            f((h + i * step) & mask);
+    }
+
+    bool contains(uint64_t kmer) const
+    {
+        bool found = true;
+        for_each_bit(kmer, [&](uint64_t bit)
+                     { found = found && (bits[bit >> 6] >> (bit & 63) & 1); });
+        return found;
+    }
+
+    /* Whether a read shares at least min_shared k-mers with the database */
+    bool passes(string_view read) const
+    {
+        int shared = 0;
+        for_each_kmer(read, [&](uint64_t kmer)
+                      { return (shared += contains(kmer)) < min_shared; });
+        return shared >= min_shared;
+    }
+
+    /* The given reads that pass the filter, in the same order */
+    vector<int> filter(const ReadStore &reads, const vector<int> &read_ids, ThreadPool &pool) const
+    {
+        // Each task checks a contiguous slice of the reads
+        const size_t slice = 1 << 14;
+        vector<char> keep(read_ids.size());
+        pool.parallel_for((read_ids.size() + slice - 1) / slice, [&](int i)
+                          {
+                              string buffer;
+                              for (size_t j = i * slice; j < min((i + 1) * slice, read_ids.size()); j++)
+                                  keep[j] = passes(reads.get(read_ids[j], buffer));
+                          });
+
+        vector<int> kept;
+        for (size_t i = 0; i < read_ids.size(); i++)
+            if (keep[i])
+                kept.push_back(read_ids[i]);
+        return kept;
+    }
+};
+
+#endif
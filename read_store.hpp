@@ -0,0 +1,157 @@
+#ifndef READ_STORE_H
+#define READ_STORE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+using namespace std;
+
+/* Reads stored back to back in one contiguous buffer, optionally 2-bit encoded
+ * Reads must be added in increasing ID order, IDs do not need to be contiguous */
+struct ReadStore
+{
+    bool packed;
+    bool paired = false;         // whether reads 2p and 2p + 1 are the mates of a pair
+    string arena;                // sequences, or 4 bases per byte when packed
+    vector<uint64_t> offsets{0}; // read i spans [offsets[i], offsets[i + 1]) bases in the arena
+    vector<int> ids;             // read ID of the i-th stored read
+    vector<uint64_t> ambiguous;  // positions of non-ACGT bases when packed, restored as 'N'
+    vector<int> duplicate_of;    // read ID of the first read with the same sequence or its reverse complement, once deduplicated
+    vector<char> reverse_of;     // whether the i-th read is the reverse complement of its duplicate_of read
+
+    explicit ReadStore(bool packed = false) : packed(packed) {}
+
+    void add(int read_id, const char *seq, size_t len)
+    {
+        uint64_t start = offsets.back();
+        if (packed)
+        {
+            arena.resize((start + len + 3) / 4);
+            for (size_t i = 0; i < len; i++)
+            {
+                uint8_t code;
+                switch (seq[i])
+                {
+                case 'A': case 'a': code = 0; break;
+                case 'C': case 'c': code = 1; break;
+                case 'G': case 'g': code = 2; break;
+                case 'T': case 't': code = 3; break;
+                default:
+                    code = 0;
+                    ambiguous.push_back(start + i);
+                }
+                arena[(start + i) / 4] |= code << ((start + i) % 4 * 2);
+            }
+        }
+        else
+            arena.append(seq, len);
+        offsets.push_back(start + len);
+        ids.push_back(read_id);
+    }
+
+    size_t size() const { return ids.size(); }
+
+    /* Index of a read in the store, or -1 if it is not stored */
+    int index_of(int read_id) const
+    {
+        if (read_id >= 0 && read_id < (int)ids.size() && ids[read_id] == read_id) // all reads stored
+            return read_id;
+        auto it = lower_bound(ids.begin(), ids.end(), read_id);
+        return it != ids.end() && *it == read_id ? it - ids.begin() : -1;
+    }
+
+    bool contains(int read_id) const { return index_of(read_id) != -1; }
+
+    size_t length(int read_id) const
+    {
+        int i = index_of(read_id);
+        return offsets[i + 1] - offsets[i];
+    }
+
+    /* Sequence of a read, packed reads are decoded into the given buffer */
+    string_view get(int read_id, string &buffer) const
+    {
+        int i = index_of(read_id);
+        uint64_t start = offsets[i], end = offsets[i + 1];
+        if (!packed)
+            return string_view(arena.data() + start, end - start);
+
+        buffer.resize(end - start);
+        for (uint64_t pos = start; pos < end; pos++)
+            buffer[pos - start] = "ACGT"[(arena[pos / 4] >> (pos % 4 * 2)) & 3];
+        for (auto it = lower_bound(ambiguous.begin(), ambiguous.end(), start); it != ambiguous.end() && *it < end; ++it)
+            buffer[*it - start] = 'N';
+        return buffer;
+    }
+
+    string get(int read_id) const
+    {
+        string buffer;
+        return string(get(read_id, buffer));
+    }
+
+    static string reverse_complement(string_view seq)
+    {
+        string rc(seq.rbegin(), seq.rend());
+        for (char &c : rc)
+            switch (c)
+            {
+            case 'A': case 'a': c = 'T'; break;
+            case 'C': case 'c': c = 'G'; break;
+            case 'G': case 'g': c = 'C'; break;
+            case 'T': case 't': c = 'A'; break;
+            default: c = 'N';
+            }
+        return rc;
+    }
+
+    /* Collapse reads with identical sequences, a read and its reverse complement count as identical
+     * Returns the number of distinct sequences */
+    size_t deduplicate()
+    {
+        duplicate_of.resize(size());
+        reverse_of.assign(size(), 0);
+        unordered_map<size_t, vector<int>> distinct; // hash of the canonical sequence to the indexes of distinct reads
+        size_t n_distinct = 0;
+        string buffer, other_buffer;
+        for (size_t i = 0; i < size(); i++)
+        {
+            string_view read = get(ids[i], buffer);
+            string rc = reverse_complement(read);
+            bool reversed = rc < read;
+            string_view canonical = reversed ? string_view(rc) : read;
+
+            duplicate_of[i] = ids[i];
+            auto &candidates = distinct[hash<string_view>{}(canonical)];
+            for (int j : candidates)
+            {
+                string_view other = get(ids[j], other_buffer);
+                if (other == read || other == rc)
+                {
+                    duplicate_of[i] = ids[j];
+                    reverse_of[i] = other != read;
+                    break;
+                }
+            }
+            if (duplicate_of[i] == ids[i])
+            {
+                candidates.push_back(i);
+                n_distinct++;
+            }
+        }
+        return n_distinct;
+    }
+
+    bool deduplicated() const { return !duplicate_of.empty(); }
+
+    int representative(int read_id) const { return duplicate_of[index_of(read_id)]; }
+
+    bool is_reverse_of_representative(int read_id) const { return reverse_of[index_of(read_id)]; }
+};
+
+#endif
@@ -0,0 +1,360 @@
+#ifndef READS_INPUT_H
+#define READS_INPUT_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <zlib.h>
+
+#include "helper.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+
+const size_t READ_BATCH_SIZE = 4096;   // reads parsed per batch
+const size_t READ_QUEUE_SIZE = 16;     // batches parsed ahead of the mappers
+const int BGZF_BLOCKS_PER_THREAD = 16; // BGZF blocks inflated per pool thread at a time, 1 MiB of bases or so
+
+/* Queue between a producer thread and a consumer, the producer blocks while capacity items are waiting */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    /* Returns false if the queue was closed, the item is then dropped */
+    bool push(T item)
+    {
+        unique_lock<mutex> lock(mtx);
+        not_full.wait(lock, [&]()
+                      { return items.size() < capacity || closed; });
+        if (closed)
+            return false;
+        items.push_back(move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    /* Returns false once the queue is closed and empty */
+    bool pop(T &item)
+    {
+        unique_lock<mutex> lock(mtx);
+        not_empty.wait(lock, [&]()
+                       { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /* No more items, by the producer when done or by the consumer to stop it */
+    void close()
+    {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    mutex mtx;
+    condition_variable not_full, not_empty;
+    deque<T> items;
+    bool closed = false;
+};
+
+/* Decompressed contents of a file, in chunks
+ * BGZF files, as written by bgzip, are split at their block boundaries and their blocks inflated on the pool, if any.
+ * Other gzip files are inflated as one stream, and uncompressed files read as is, both by zlib with a large buffer. */
+class Decompressor
+{
+public:
+    Decompressor(const string &file, ThreadPool *pool) : file(file), pool(pool)
+    {
+        if (is_bgzf(file))
+            bgzf_in = expect(fopen(file.c_str(), "rb"), "[x] Failed to open reads file " + file);
+        else
+        {
+            gz_in = expect(gzopen(file.c_str(), "rb"), "[x] Failed to open reads file " + file);
+            gzbuffer(gz_in, 1 << 20);
+        }
+    }
+
+    ~Decompressor()
+    {
+        if (bgzf_in)
+            fclose(bgzf_in);
+        if (gz_in)
+            gzclose(gz_in);
+    }
+
+    /* Replace chunk with the next part of the contents, returns false at the end */
+    bool read(string &chunk)
+    {
+        if (gz_in)
+        {
+            chunk.resize(1 << 20);
+            int n = gzread(gz_in, &chunk[0], chunk.size());
+            expect(n >= 0, "[x] Failed to decompress " + file);
+            chunk.resize(n);
+            return n > 0;
+        }
+        vector<string> blocks;
+        string block;
+        int batch_blocks = (pool ? pool->size() : 1) * BGZF_BLOCKS_PER_THREAD;
+        while ((int)blocks.size() < batch_blocks && read_block(block))
+            blocks.push_back(move(block));
+        if (blocks.empty())
+            return false;
+
+        // Each block's uncompressed size is in its last 4 bytes, so every block is inflated straight into place
+        vector<size_t> offsets{0};
+        for (const auto &b : blocks)
+            offsets.push_back(offsets.back() + le32(b.data() + b.size() - 4));
+        chunk.resize(offsets.back());
+        vector<char> failed(blocks.size(), 0);
+        auto inflate = [&](int i)
+        { failed[i] = !inflate_block(blocks[i], &chunk[offsets[i]], offsets[i + 1] - offsets[i]); };
+        if (pool)
+            pool->run_shared(blocks.size(), inflate);
+        else
+            for (size_t i = 0; i < blocks.size(); i++)
+                inflate(i);
+        expect(count(failed.begin(), failed.end(), 1) == 0, "[x] Corrupt BGZF block in " + file);
+        return true;
+    }
+
+    /* Whether a file starts with a BGZF block: a gzip member with a `BC` extra field */
+    static bool is_bgzf(const string &file)
+    {
+        unsigned char header[16];
+        FILE *in = fopen(file.c_str(), "rb");
+        if (!in)
+            return false;
+        bool bgzf = fread(header, 1, sizeof(header), in) == sizeof(header) && header[0] == 0x1f && header[1] == 0x8b &&
+                    (header[3] & 4) && header[12] == 'B' && header[13] == 'C' && header[14] == 2 && header[15] == 0;
+        fclose(in);
+        return bgzf;
+    }
+
+private:
+    string file;
+    ThreadPool *pool;
+    FILE *bgzf_in = nullptr;
+    gzFile gz_in = nullptr;
+
+    static uint32_t le32(const char *p)
+    {
+        uint32_t value;
+        memcpy(&value, p, 4);
+        return value;
+    }
+
+    /* Next BGZF block as stored, returns false at the end of the file */
+    bool read_block(string &block)
+    {
+        char header[18];
+        size_t n = fread(header, 1, sizeof(header), bgzf_in);
+        if (n == 0)
+            return false;
+        expect(n == sizeof(header) && (unsigned char)header[0] == 0x1f && (unsigned char)header[1] == 0x8b && header[12] == 'B' && header[13] == 'C',
+               "[x] " + file + " mixes BGZF and other gzip blocks, recompress it with bgzip or gzip");
+        uint16_t block_size;
+        memcpy(&block_size, header + 16, 2);
+        block.assign(header, sizeof(header));
+        block.resize(block_size + 1);
+        expect(block.size() >= 26 && fread(&block[sizeof(header)], 1, block.size() - sizeof(header), bgzf_in) == block.size() - sizeof(header),
+               "[x] Truncated BGZF block in " + file);
+        return true;
+    }
+
+    /* Inflate a BGZF block into out and check its CRC */
+    static bool inflate_block(const string &block, char *out, size_t size)
+    {
+        uint16_t extra_size;
+        memcpy(&extra_size, block.data() + 10, 2);
+        size_t start = 12 + extra_size;
+        if (start + 8 > block.size())
+            return false;
+        z_stream zs = {};
+        if (inflateInit2(&zs, -15) != Z_OK)
+            return false;
+        zs.next_in = (Bytef *)block.data() + start;
+        zs.avail_in = block.size() - start - 8;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = size;
+        int status = inflate(&zs, Z_FINISH);
+        bool complete = status == Z_STREAM_END && zs.total_out == size;
+        inflateEnd(&zs);
+        return complete && crc32(0, (const Bytef *)out, size) == le32(block.data() + block.size() - 8);
+    }
+};
+
+/* Names and sequences of consecutive reads, stored back to back */
+struct FastxBatch
+{
+    string names;
+    string seqs;
+    vector<size_t> name_ends;
+    vector<size_t> seq_ends;
+
+    size_t size() const { return name_ends.size(); }
+
+    string_view name(size_t i) const { return string_view(names).substr(i ? name_ends[i - 1] : 0, name_ends[i] - (i ? name_ends[i - 1] : 0)); }
+
+    string_view seq(size_t i) const { return string_view(seqs).substr(i ? seq_ends[i - 1] : 0, seq_ends[i] - (i ? seq_ends[i - 1] : 0)); }
+};
+
+/* Reads of a FASTA or FASTQ file, plain or compressed, parsed on a thread of their own
+ * The thread decompresses, with the pool's help for BGZF, and parses batches of reads into a bounded queue, so
+ * parsing runs ahead of the mappers by at most READ_QUEUE_SIZE batches. FASTA sequences may span several lines, as may
+ * FASTQ sequences and qualities. Names end at the first whitespace. */
+class FastxReader
+{
+public:
+    FastxReader(const string &file, ThreadPool *pool) : file(file), input(file, pool), batches(READ_QUEUE_SIZE)
+    {
+        parser = thread(&FastxReader::parse, this);
+    }
+
+    ~FastxReader()
+    {
+        batches.close();
+        parser.join();
+    }
+
+    /* Next read, its name and sequence are valid until the next call, returns false at the end of the file */
+    bool next(string_view &name, string_view &seq)
+    {
+        if (++current >= batch.size())
+        {
+            if (!batches.pop(batch))
+            {
+                if (error)
+                    rethrow_exception(error);
+                return false;
+            }
+            current = 0;
+        }
+        name = batch.name(current);
+        seq = batch.seq(current);
+        return true;
+    }
+
+private:
+    string file;
+    Decompressor input;
+    BoundedQueue<FastxBatch> batches;
+    thread parser;
+    exception_ptr error;
+    FastxBatch batch;
+    size_t current = 0;
+
+    string buffer; // decompressed text not parsed yet, from pos on
+    size_t pos = 0;
+    string chunk;
+    string header; // header line of the next record, once read
+
+    void parse()
+    {
+        try
+        {
+            bool more = true;
+            while (more)
+            {
+                FastxBatch parsed;
+                while (parsed.size() < READ_BATCH_SIZE && (more = parse_record(parsed)))
+                    ;
+                if (parsed.size() && !batches.push(move(parsed)))
+                    return; // the consumer stopped
+            }
+        }
+        catch (...)
+        {
+            error = current_exception();
+        }
+        batches.close();
+    }
+
+    /* Next line without its line break, valid until the next call, returns false at the end of the file */
+    bool next_line(string_view &line)
+    {
+        size_t end;
+        while ((end = buffer.find('\n', pos)) == string::npos)
+        {
+            buffer.erase(0, pos);
+            pos = 0;
+            if (!input.read(chunk))
+            {
+                if (buffer.empty())
+                    return false;
+                end = buffer.size(); // last line without a line break
+                buffer += '\n';
+                break;
+            }
+            buffer += chunk;
+        }
+        line = string_view(buffer).substr(pos, end - pos);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        pos = end + 1;
+        return true;
+    }
+
+    /* Parse the next record into batch, returns false at the end of the file */
+    bool parse_record(FastxBatch &batch)
+    {
+        string_view line;
+        while (header.empty())
+        {
+            if (!next_line(line))
+                return false;
+            header = line;
+        }
+        char type = header[0];
+        expect(type == '>' || type == '@', "[x] Expected a FASTA or FASTQ record in " + file + ", found: " + header.substr(0, 50));
+        batch.names.append(header, 1, header.find_first_of(" \t", 1) - 1);
+        batch.name_ends.push_back(batch.names.size());
+        header.clear();
+
+        size_t seq_length = 0;
+        bool quality = false;
+        while (next_line(line))
+        {
+            if (type == '>' && !line.empty() && line[0] == '>')
+            {
+                header = line;
+                break;
+            }
+            if (type == '@' && !line.empty() && line[0] == '+')
+            {
+                // The quality is as long as the sequence, so a quality line starting with `@` is not taken for a header
+                size_t quality_length = 0;
+                while (quality_length < seq_length && next_line(line))
+                    quality_length += line.size();
+                expect(quality_length == seq_length, "[x] Truncated FASTQ record in " + file);
+                quality = true;
+                break;
+            }
+            batch.seqs.append(line);
+            seq_length += line.size();
+        }
+        expect(type == '>' || quality, "[x] Truncated FASTQ record in " + file);
+        batch.seq_ends.push_back(batch.seqs.size());
+        return true;
+    }
+};
+
+#endif
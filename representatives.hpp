@@ -0,0 +1,196 @@
+#ifndef REPRESENTATIVES_H
+#define REPRESENTATIVES_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <unistd.h>
+
+#include "kir.hpp"
+#include "prefilter.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+
+const size_t SKETCH_SIZE = 256; // hashes kept per allele
+
+/* Bottom-s MinHash sketch of the canonical k-mers of a sequence, sorted */
+vector<uint64_t> kmer_sketch(string_view seq)
+{
+    vector<uint64_t> hashes;
+    KmerFilter::for_each_kmer(seq, [&](uint64_t kmer)
+                              {
+                                  // splitmix64 finalizer, so that the smallest hashes are a uniform sample of the k-mers
+                                  uint64_t h = kmer + 0x9e3779b97f4a7c15ULL;
+                                  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                                  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+                                  hashes.push_back(h ^ (h >> 31));
+                                  return true;
+                              });
+    sort(hashes.begin(), hashes.end());
+    hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+    if (hashes.size() > SKETCH_SIZE)
+        hashes.resize(SKETCH_SIZE);
+    return hashes;
+}
+
+/* 1 - Jaccard similarity, estimated from the smallest hashes of the union of two sketches */
+double sketch_distance(const vector<uint64_t> &a, const vector<uint64_t> &b)
+{
+    size_t i = 0, j = 0, n_union = 0, n_shared = 0;
+    while (n_union < SKETCH_SIZE && (i < a.size() || j < b.size()))
+    {
+        if (j == b.size() || (i < a.size() && a[i] < b[j]))
+            i++;
+        else if (i == a.size() || b[j] < a[i])
+            j++;
+        else
+        {
+            i++;
+            j++;
+            n_shared++;
+        }
+        n_union++;
+    }
+    return n_union ? 1.0 - (double)n_shared / n_union : 0.0;
+}
+
+/* Greedy k-medoids: each step adds the allele that most reduces the total distance of all alleles to their nearest
+ * pick, so the first pick is the medoid of the gene and the following ones cover the alleles furthest from it.
+ * The picks for n are the first n picks for any larger n. Ties go to the first allele in name order. */
+vector<int> select_medoids(const IndexSequences &alleles, int n)
+{
+    size_t m = alleles.size();
+    vector<vector<uint64_t>> sketches;
+    for (const auto &seq : alleles.seqs)
+        sketches.push_back(kmer_sketch(seq));
+    vector<double> distance(m * m, 0.0);
+    for (size_t i = 0; i < m; i++)
+        for (size_t j = i + 1; j < m; j++)
+            distance[i * m + j] = distance[j * m + i] = sketch_distance(sketches[i], sketches[j]);
+
+    vector<int> picks;
+    vector<double> nearest(m, 2.0); // distance to the nearest pick, above any real distance before the first pick
+    vector<char> picked(m, 0);
+    while ((int)picks.size() < n && picks.size() < m)
+    {
+        int best = -1;
+        double best_cost = 0;
+        for (size_t c = 0; c < m; c++)
+        {
+            if (picked[c])
+                continue;
+            double cost = 0;
+            for (size_t i = 0; i < m; i++)
+                cost += min(nearest[i], distance[i * m + c]);
+            if (best == -1 || cost < best_cost)
+            {
+                best = c;
+                best_cost = cost;
+            }
+        }
+        picks.push_back(best);
+        picked[best] = 1;
+        for (size_t i = 0; i < m; i++)
+            nearest[i] = min(nearest[i], distance[i * m + best]);
+    }
+    return picks;
+}
+
+/* Up to num_representatives alleles per gene, chosen by select_medoids
+ * The picks are cached in cache_file, keyed by the content of each gene, and extended when more are needed, so a new
+ * database release only recomputes the genes that changed */
+IndexSequences extract_representatives(const AlleleDict &dict, const unordered_map<string, unordered_map<string, string>> &kirs, int num_representatives, ThreadPool &pool, const string &cache_file = "")
+{
+    vector<IndexSequences> gene_alleles;
+    vector<string> gene_keys;
+    for (const auto &gene : dict.genes)
+    {
+        gene_alleles.push_back(gene_sequences(dict, gene, kirs.at(gene)));
+        char key[32];
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)gene_hash(gene_alleles.back(), fnv1a(&SKETCH_SIZE, sizeof(SKETCH_SIZE))));
+        gene_keys.push_back(key);
+    }
+
+    // Cached picks, one line per gene: `<gene>\t<gene hash>\t<allele>,<allele>,...`, picks of changed genes are ignored
+    unordered_map<string, vector<string>> cached;
+    ifstream cache_in(cache_file);
+    string line;
+    unordered_map<string, string> current_keys;
+    for (size_t gene_id = 0; gene_id < dict.genes.size(); gene_id++)
+        current_keys[dict.genes[gene_id]] = gene_keys[gene_id];
+    while (!cache_file.empty() && getline(cache_in, line))
+    {
+        stringstream fields(line);
+        string gene, key, alleles;
+        if (!getline(fields, gene, '\t') || !getline(fields, key, '\t') || !getline(fields, alleles))
+            continue;
+        auto current = current_keys.find(gene);
+        if (current == current_keys.end() || current->second != key)
+            continue;
+        auto &picks = cached[gene];
+        stringstream names(alleles);
+        string allele;
+        while (getline(names, allele, ','))
+            picks.push_back(allele);
+    }
+
+    vector<vector<int>> picks(dict.genes.size());
+    vector<char> computed(dict.genes.size(), 0);
+    pool.parallel_for(dict.genes.size(), [&](int gene_id)
+                      {
+                          const IndexSequences &alleles = gene_alleles[gene_id];
+                          size_t wanted = min((size_t)num_representatives, alleles.size());
+                          auto it = cached.find(dict.genes[gene_id]);
+                          if (it != cached.end() && it->second.size() >= wanted)
+                              for (size_t i = 0; i < wanted; i++) // names are sorted, as the alleles are in name order
+                                  picks[gene_id].push_back(lower_bound(alleles.names.begin(), alleles.names.end(), dict.genes[gene_id] + "." + it->second[i]) - alleles.names.begin());
+                          else
+                          {
+                              picks[gene_id] = select_medoids(alleles, num_representatives);
+                              computed[gene_id] = 1;
+                          }
+                      });
+
+    if (!cache_file.empty() && count(computed.begin(), computed.end(), 1))
+    {
+        // Keep the longer list of picks of each gene, the shorter one is a prefix of it
+        string tmp_file = cache_file + ".tmp." + to_string(getpid()) + "_" + to_string(std::hash<thread::id>{}(this_thread::get_id()));
+        ofstream cache_out(tmp_file);
+        for (size_t gene_id = 0; gene_id < dict.genes.size(); gene_id++)
+        {
+            const string &gene = dict.genes[gene_id];
+            vector<string> names;
+            for (int i : picks[gene_id])
+                names.push_back(dict.alleles[gene_alleles[gene_id].allele_ids[i]]);
+            if (cached.count(gene) && cached[gene].size() > names.size())
+                names = cached[gene];
+            cache_out << gene << '\t' << gene_keys[gene_id];
+            for (size_t i = 0; i < names.size(); i++)
+                cache_out << (i ? ',' : '\t') << names[i];
+            cache_out << '\n';
+        }
+        cache_out.close();
+        if (!cache_out || rename(tmp_file.c_str(), cache_file.c_str()) != 0) // the cache is optional, e.g. a read-only database directory
+            remove(tmp_file.c_str());
+    }
+
+    IndexSequences representatives;
+    for (size_t gene_id = 0; gene_id < dict.genes.size(); gene_id++)
+    {
+        const IndexSequences &alleles = gene_alleles[gene_id];
+        for (int i : picks[gene_id])
+            representatives.add(alleles.names[i], alleles.seqs[i], alleles.allele_ids[i]);
+    }
+    return representatives;
+}
+
+#endif
@@ -0,0 +1,318 @@
+#ifndef SAM_FORMAT_H
+#define SAM_FORMAT_H
+
+#include <string>
+#include <vector>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+
+#include "helper.hpp"
+#include "alignment.hpp"
+#include "read_store.hpp"
+
+using namespace std;
+
+/* Format of an alignments file, from its name: `.paf`, `.sam`, `.bam` or `.kab`, and TSV otherwise
+ * Text formats may end with `.gz` as well */
+enum class OutputFormat
+{
+    TSV,
+    PAF,
+    SAM,
+    BAM,
+    KAB
+};
+
+bool ends_with(const string &name, const string &suffix)
+{
+    return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+OutputFormat output_format(string file)
+{
+    if (ends_with(file, ".kab"))
+        return OutputFormat::KAB;
+    if (ends_with(file, ".gz"))
+        file.resize(file.size() - 3);
+    if (ends_with(file, ".paf"))
+        return OutputFormat::PAF;
+    if (ends_with(file, ".sam"))
+        return OutputFormat::SAM;
+    if (ends_with(file, ".bam"))
+        return OutputFormat::BAM;
+    return OutputFormat::TSV;
+}
+
+const size_t BGZF_BLOCK_SIZE = 0xff00; // input bytes per BGZF block, so that a block never exceeds 64 KiB compressed
+const unsigned char BGZF_EOF[28] = {0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 'B', 'C', 0x02, 0, 0x1b, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/* One BGZF block of at most BGZF_BLOCK_SIZE bytes: a gzip member that carries its compressed size, which BAM readers
+ * need to seek */
+string bgzf_block(const char *data, size_t length)
+{
+    unsigned char block[1 << 16];
+    const unsigned char header[18] = {0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 'B', 'C', 0x02, 0, 0, 0};
+    memcpy(block, header, sizeof(header));
+
+    z_stream zs = {};
+    expect(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK, "Failed to initialize BGZF compression");
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = length;
+    zs.next_out = block + sizeof(header);
+    zs.avail_out = sizeof(block) - sizeof(header) - 8;
+    expect(deflate(&zs, Z_FINISH) == Z_STREAM_END, "Failed to compress alignments");
+    size_t size = sizeof(header) + zs.total_out + 8;
+    deflateEnd(&zs);
+
+    uint32_t crc = crc32(0, (const Bytef *)data, length), input_size = length;
+    uint16_t block_size = size - 1;
+    memcpy(block + 16, &block_size, 2);
+    memcpy(block + size - 8, &crc, 4);
+    memcpy(block + size - 4, &input_size, 4);
+    return string((const char *)block, size);
+}
+
+/* Alignments in the standard formats, for the tools that read them
+ *   PAF  one line per hit, with the mismatches as NM and the CIGAR as cg
+ *   SAM  one line per hit, with an @SQ header line per allele. The first hit of a read in the file is its primary
+ *        alignment and carries its sequence, clipped with S; the other hits are secondary, clipped with H.
+ *   BAM  the SAM records in binary, compressed by the writer in BGZF blocks
+ * Reads are named by read ID, except that mates are named by pair number in SAM and BAM and flagged as first and
+ * second mate. Pairs are placed allele by allele: the mate fields come from the mate's first hit on the same allele,
+ * and a mate without one there is flagged as unmapped. Base qualities are not kept, so QUAL is `*`, and mapping qualities are 255 (unavailable). A read that
+ * is not in the read store gets no sequence or clipping, and the end of its hit as its length in PAF. */
+class AlignmentFormatter
+{
+public:
+    AlignmentFormatter(OutputFormat format, const AlleleDict &dict, const vector<int> &allele_lengths, const ReadStore *reads)
+        : format(format), dict(dict), allele_lengths(allele_lengths), reads(reads)
+    {
+        expect(allele_lengths.size() == dict.alleles.size(), "[x] Allele lengths are needed to write PAF, SAM or BAM");
+    }
+
+    /* Whether a format needs the reads, for their lengths and sequences */
+    static bool needs_reads(OutputFormat format) { return format == OutputFormat::PAF || format == OutputFormat::SAM || format == OutputFormat::BAM; }
+
+    /* Start of the file: the SAM header, with the alleles as references */
+    string header() const
+    {
+        if (format == OutputFormat::PAF)
+            return "";
+        string text = "@HD\tVN:1.6\tSO:unsorted\n";
+        for (size_t allele_id = 0; allele_id < dict.alleles.size(); allele_id++)
+            text += "@SQ\tSN:" + dict.name(allele_id) + "\tLN:" + to_string(allele_lengths[allele_id]) + "\n";
+        text += "@PG\tID:kiral\tPN:kiral\n";
+        if (format == OutputFormat::SAM)
+            return text;
+
+        string bam("BAM\1", 4);
+        append_value<int32_t>(bam, text.size());
+        bam += text;
+        append_value<int32_t>(bam, dict.alleles.size());
+        for (size_t allele_id = 0; allele_id < dict.alleles.size(); allele_id++)
+        {
+            string name = dict.name(allele_id);
+            append_value<int32_t>(bam, name.size() + 1);
+            bam.append(name.c_str(), name.size() + 1);
+            append_value<int32_t>(bam, allele_lengths[allele_id]);
+        }
+        return bam;
+    }
+
+    /* Append a hit, hits must be appended in file order so that the first hit of each read is the primary one */
+    void append(string &block, const AlignmentRecord &record, const AlignmentSet &alignments)
+    {
+        int read_len = reads && reads->contains(record.read_id) ? reads->length(record.read_id) : -1;
+        const uint32_t *cigar = alignments.cigars.data() + record.cigar_offset;
+        if (format == OutputFormat::PAF)
+            return append_paf(block, record, cigar, read_len);
+
+        if ((size_t)record.read_id >= primary_written.size())
+            primary_written.resize(max<size_t>(record.read_id + 1, primary_written.size() * 2), 0);
+        bool primary = !primary_written[record.read_id];
+        primary_written[record.read_id] = 1;
+
+        // Clips are in the orientation of the allele, as is the CIGAR
+        int flag = (record.reversed ? 0x10 : 0) | (primary ? 0 : 0x100);
+        bool paired = reads && reads->paired;
+        const AlignmentRecord *mate = paired ? mate_hit(record, alignments) : nullptr;
+        if (paired)
+            flag |= 0x1 | (record.read_id % 2 ? 0x80 : 0x40) | (!mate ? 0x8 : (mate->reversed ? 0x20 : 0) | (is_proper_pair(record, *mate) ? 0x2 : 0));
+        int template_length = 0;
+        if (mate) // signed span of the pair, positive for the leftmost mate
+        {
+            int span = max(record.query_end, mate->query_end) - min(record.query_start, mate->query_start);
+            bool leftmost = record.query_start < mate->query_start || (record.query_start == mate->query_start && record.read_id % 2 == 0);
+            template_length = leftmost ? span : -span;
+        }
+        vector<uint32_t> ops;
+        uint32_t clip_op = primary ? 4 : 5; // S or H
+        int front = record.reversed ? read_len - record.read_end : record.read_start;
+        int back = record.reversed ? record.read_start : read_len - record.read_end;
+        if (read_len >= 0 && front > 0)
+            ops.push_back((uint32_t)front << 4 | clip_op);
+        ops.insert(ops.end(), cigar, cigar + record.n_cigar);
+        if (read_len >= 0 && back > 0)
+            ops.push_back((uint32_t)back << 4 | clip_op);
+        string seq;
+        if (primary && read_len >= 0)
+        {
+            seq = reads->get(record.read_id, buffer);
+            if (record.reversed)
+                seq = ReadStore::reverse_complement(seq);
+        }
+        int name = paired ? record.read_id / 2 : record.read_id;
+
+        if (format == OutputFormat::SAM)
+        {
+            append_number(block, name);
+            block += '\t';
+            append_number(block, flag);
+            block += '\t';
+            block += dict.name(record.allele_id);
+            block += '\t';
+            append_number(block, record.query_start + 1);
+            block += "\t255\t";
+            for (uint32_t op : ops)
+            {
+                append_number(block, op >> 4);
+                block += MM_CIGAR_STR[op & 0xf];
+            }
+            block += mate ? "\t=\t" : "\t*\t";
+            append_number(block, mate ? mate->query_start + 1 : 0);
+            block += '\t';
+            append_number(block, template_length);
+            block += '\t';
+            block += seq.empty() ? "*" : seq;
+            block += "\t*\tNM:i:";
+            append_number(block, record.cost);
+            block += '\n';
+            return;
+        }
+
+        string read_name = to_string(name);
+        size_t start = block.size();
+        append_value<int32_t>(block, 0); // block size, set below
+        append_value<int32_t>(block, record.allele_id);
+        append_value<int32_t>(block, record.query_start);
+        append_value<uint8_t>(block, read_name.size() + 1);
+        append_value<uint8_t>(block, 255);
+        append_value<uint16_t>(block, reg2bin(record.query_start, record.query_end));
+        append_value<uint16_t>(block, ops.size());
+        append_value<uint16_t>(block, flag);
+        append_value<int32_t>(block, seq.size());
+        append_value<int32_t>(block, mate ? record.allele_id : -1);
+        append_value<int32_t>(block, mate ? mate->query_start : -1);
+        append_value<int32_t>(block, template_length);
+        block.append(read_name.c_str(), read_name.size() + 1);
+        for (uint32_t op : ops) // minimap2 numbers CIGAR ops as BAM does
+            append_value<uint32_t>(block, op);
+        for (size_t i = 0; i < seq.size(); i += 2)
+            block += (char)(base_code(seq[i]) << 4 | (i + 1 < seq.size() ? base_code(seq[i + 1]) : 0));
+        block.append(seq.size(), '\xff');
+        block += "NMi";
+        append_value<int32_t>(block, record.cost);
+        int32_t size = block.size() - start - 4;
+        memcpy(&block[start], &size, 4);
+    }
+
+private:
+    OutputFormat format;
+    const AlleleDict &dict;
+    const vector<int> &allele_lengths;
+    const ReadStore *reads;
+    vector<char> primary_written; // whether the primary hit of each read, by read ID, was written
+    string buffer;
+
+    /* First hit of the mate of a read on the same allele, in a set sorted by allele then read, mates are reads 2p and
+     * 2p + 1 */
+    static const AlignmentRecord *mate_hit(const AlignmentRecord &record, const AlignmentSet &alignments)
+    {
+        auto key = make_pair(record.allele_id, record.read_id ^ 1);
+        auto it = lower_bound(alignments.records.begin(), alignments.records.end(), key, [](const AlignmentRecord &r, const pair<int, int> &key)
+                              { return make_pair(r.allele_id, r.read_id) < key; });
+        return it != alignments.records.end() && make_pair(it->allele_id, it->read_id) == key ? &*it : nullptr;
+    }
+
+    void append_paf(string &block, const AlignmentRecord &record, const uint32_t *cigar, int read_len)
+    {
+        int block_len = 0;
+        for (uint32_t k = 0; k < record.n_cigar; k++)
+            if (strchr("MID=X", MM_CIGAR_STR[cigar[k] & 0xf]))
+                block_len += cigar[k] >> 4;
+        append_number(block, record.read_id);
+        block += '\t';
+        append_number(block, read_len >= 0 ? read_len : record.read_end);
+        block += '\t';
+        append_number(block, record.read_start);
+        block += '\t';
+        append_number(block, record.read_end);
+        block += record.reversed ? "\t-\t" : "\t+\t";
+        block += dict.name(record.allele_id);
+        block += '\t';
+        append_number(block, allele_lengths[record.allele_id]);
+        block += '\t';
+        append_number(block, record.query_start);
+        block += '\t';
+        append_number(block, record.query_end);
+        block += '\t';
+        append_number(block, max(block_len - record.cost, 0));
+        block += '\t';
+        append_number(block, block_len);
+        block += "\t255\tNM:i:";
+        append_number(block, record.cost);
+        block += "\tcg:Z:";
+        for (uint32_t k = 0; k < record.n_cigar; k++)
+        {
+            append_number(block, cigar[k] >> 4);
+            block += MM_CIGAR_STR[cigar[k] & 0xf];
+        }
+        block += '\n';
+    }
+
+    static void append_number(string &block, int value)
+    {
+        char number[16];
+        block.append(number, to_chars(number, number + sizeof(number), value).ptr);
+    }
+
+    template <typename T>
+    static void append_value(string &block, T value)
+    {
+        block.append((const char *)&value, sizeof(value));
+    }
+
+    static uint8_t base_code(char base)
+    {
+        switch (base)
+        {
+        case 'A': case 'a': return 1;
+        case 'C': case 'c': return 2;
+        case 'G': case 'g': return 4;
+        case 'T': case 't': return 8;
+        default: return 15;
+        }
+    }
+
+    /* BAM bin of the 0-based [begin, end) range, as in the SAM specification */
+    static int reg2bin(int begin, int end)
+    {
+        --end;
+        if (begin >> 14 == end >> 14)
+            return ((1 << 15) - 1) / 7 + (begin >> 14);
+        if (begin >> 17 == end >> 17)
+            return ((1 << 12) - 1) / 7 + (begin >> 17);
+        if (begin >> 20 == end >> 20)
+            return ((1 << 9) - 1) / 7 + (begin >> 20);
+        if (begin >> 23 == end >> 23)
+            return ((1 << 6) - 1) / 7 + (begin >> 23);
+        if (begin >> 26 == end >> 26)
+            return ((1 << 3) - 1) / 7 + (begin >> 26);
+        return 0;
+    }
+};
+
+#endif
@@ -0,0 +1,318 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <sstream>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "helper.hpp"
+#include "pipeline.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+
+const size_t MAX_REQUEST_SIZE = 64 << 10; // bytes of a request line
+const int CLIENT_TIMEOUT = 5;             // seconds a client has to send its request and read the reply
+
+/* Alignment daemon on a Unix domain socket
+ *
+ * Each connection sends one request line and gets the reply before the server closes it. Requests are read on the
+ * accepting thread, so a client that sends more than MAX_REQUEST_SIZE bytes or stalls for CLIENT_TIMEOUT seconds gets an
+ * error instead of holding up the others:
+ *   align <reads_file> [<mates_file>] <output_file> [--method <m>] [-r <n>] [--pair] [--stream] [--dedup] [--pack-reads] [--genotype] [--update]
+ *                      queues a job and replies `queued <job_id>`, with --genotype the output file gets the genotype,
+ *                      and with --update the output file is updated in place for the genes changed since it was written
+ *   status [<job_id>]  one line per job: `<job_id> <state> <reads_file> <output_file> <alignments> <seconds> [error]`
+ *   metrics            the --stats JSON of everything run so far, stages summed by name
+ *   shutdown           stops accepting jobs and exits once the queued jobs are done
+ * Replies to invalid requests start with `error`. */
+class AlignmentServer
+{
+public:
+    AlignmentServer(AlignmentContext &context, const AlignOptions &defaults, ThreadPool &pool, int max_jobs)
+        : context(context), defaults(defaults), pool(pool), max_jobs(max(max_jobs, 1))
+    {
+        stats.aggregate_stages = true; // stages of every job would otherwise pile up for as long as the server runs
+    }
+
+    /* Serve requests on socket_path until a shutdown request, then wait for the jobs in flight */
+    void serve(const string &socket_path)
+    {
+        int server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server < 0)
+            throw runtime_error("[x] Failed to create socket");
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        expect(socket_path.size() < sizeof(address.sun_path), "[x] Socket path too long: " + socket_path);
+        strcpy(address.sun_path, socket_path.c_str());
+        unlink(socket_path.c_str());
+        expect(bind(server, (sockaddr *)&address, sizeof(address)) == 0, "[x] Failed to bind " + socket_path);
+        expect(listen(server, 16) == 0, "[x] Failed to listen on " + socket_path);
+        cout << "[+] Listening on " << socket_path << endl;
+
+        bool stopping = false;
+        while (!stopping)
+        {
+            int client = accept(server, nullptr, nullptr);
+            if (client < 0)
+            {
+                // Out of descriptors or buffers: back off until jobs release some, rather than spin on accept
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                {
+                    cerr << "[x] Failed to accept a connection: " << strerror(errno) << ", retrying" << endl;
+                    this_thread::sleep_for(chrono::milliseconds(100));
+                }
+                else if (errno != EINTR && errno != ECONNABORTED)
+                {
+                    // The socket itself is broken, stop serving as on shutdown so the jobs in flight still finish
+                    cerr << "[x] Failed to accept a connection: " << strerror(errno) << ", shutting down" << endl;
+                    stopping = true;
+                }
+                continue;
+            }
+            timeval timeout = {CLIENT_TIMEOUT, 0};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            string request;
+            char buffer[4096];
+            ssize_t n = 0;
+            while (request.find('\n') == string::npos && request.size() <= MAX_REQUEST_SIZE && (n = read(client, buffer, sizeof(buffer))) > 0)
+                request.append(buffer, n);
+
+            string reply;
+            if (request.find('\n') == string::npos && request.size() > MAX_REQUEST_SIZE)
+                reply = "error request longer than " + to_string(MAX_REQUEST_SIZE) + " bytes\n";
+            else if (n < 0)
+                reply = "error no request within " + to_string(CLIENT_TIMEOUT) + " seconds\n";
+            else
+                reply = handle(request.substr(0, request.find('\n')), stopping);
+            for (size_t written = 0; written < reply.size();)
+            {
+                n = send(client, reply.data() + written, reply.size() - written, MSG_NOSIGNAL); // a client gone early must not kill the server
+                if (n <= 0)
+                    break;
+                written += n;
+            }
+            close(client);
+        }
+        close(server);
+        unlink(socket_path.c_str());
+
+        pool.wait(lanes);
+        cout << "[+] Served " << jobs.size() << " job(s)." << endl;
+    }
+
+private:
+    struct Job
+    {
+        int id;
+        SampleFiles files;
+        AlignOptions options;
+        string state = "queued"; // queued, running, done or failed
+        size_t alignments = 0;
+        double start_time = 0;
+        double end_time = 0;
+        string error;
+    };
+
+    AlignmentContext &context;
+    AlignOptions defaults;
+    ThreadPool &pool;
+    int max_jobs;
+
+    mutex mtx;
+    map<int, shared_ptr<Job>> jobs;
+    deque<shared_ptr<Job>> queued;
+    int running_lanes = 0;
+    TaskGroup lanes;
+
+    string handle(const string &request, bool &stopping)
+    {
+        stringstream fields(request);
+        vector<string> args;
+        for (string arg; fields >> arg;)
+            args.push_back(arg);
+        if (args.empty())
+            return "error empty request\n";
+
+        if (args[0] == "align")
+            return submit(args);
+        if (args[0] == "status")
+        {
+            lock_guard<mutex> lock(mtx);
+            string reply;
+            for (const auto &job : jobs)
+                if (args.size() < 2 || to_string(job.first) == args[1])
+                    reply += describe(*job.second);
+            return reply.empty() && args.size() >= 2 ? "error unknown job " + args[1] + "\n" : reply;
+        }
+        if (args[0] == "metrics")
+            return stats.json();
+        if (args[0] == "shutdown")
+        {
+            stopping = true;
+            return "ok\n";
+        }
+        return "error unknown request " + args[0] + "\n";
+    }
+
+    string submit(const vector<string> &args)
+    {
+        bool with_mates = args.size() > 3 && args[3][0] != '-';
+        if (args.size() < 3)
+            return "error usage: align <reads_file> [<mates_file>] <output_file> [options]\n";
+        auto job = make_shared<Job>();
+        job->files.reads_file = args[1];
+        job->files.mates_file = with_mates ? args[2] : "";
+        job->files.output_file = args[with_mates ? 3 : 2];
+        job->options = defaults;
+
+        // Options that shape the database, the indexes or the pool are fixed when the server starts
+        vector<const char *> argv;
+        for (const auto &arg : args)
+            argv.push_back(arg.c_str());
+        argv.push_back(nullptr);
+        for (int i = with_mates ? 4 : 3; i < (int)args.size(); i++)
+        {
+            if (args[i] == "-t" || args[i] == "--cache" || args[i] == "--prefilter")
+                return "error " + args[i] + " is set when the server starts\n";
+            if (args[i] == "--genotype")
+            {
+                if (job->files.genotype_file.empty())
+                    swap(job->files.output_file, job->files.genotype_file);
+                continue;
+            }
+            if (args[i] == "--update")
+            {
+                job->files.previous_file = args[with_mates ? 3 : 2];
+                continue;
+            }
+            bool has_value = args[i] == "--method" || args[i] == "-r";
+            if (has_value && i + 1 == (int)args.size())
+                return "error missing value for " + args[i] + "\n";
+            int parsed;
+            try
+            {
+                parsed = parse_align_option(argv.data(), i, job->options);
+            }
+            catch (const exception &)
+            {
+                parsed = -1;
+            }
+            if (parsed < 0)
+                return "error invalid value for " + args[i - has_value] + "\n";
+            if (parsed == 0)
+                return "error unknown option " + args[i] + "\n";
+        }
+
+        if (!job->files.previous_file.empty() && !job->files.genotype_file.empty())
+            return "error --update can't be used with --genotype\n";
+
+        lock_guard<mutex> lock(mtx);
+        job->id = jobs.size() + 1;
+        jobs[job->id] = job;
+        queued.push_back(job);
+        // Each lane runs queued jobs one after the other, so at most max_jobs samples hold their reads in memory
+        if (running_lanes < max_jobs)
+        {
+            running_lanes++;
+            pool.submit(lanes, [this]()
+                        { run_lane(); });
+        }
+        return "queued " + to_string(job->id) + "\n";
+    }
+
+    void run_lane()
+    {
+        ostream quiet(nullptr);
+        while (true)
+        {
+            shared_ptr<Job> job;
+            {
+                lock_guard<mutex> lock(mtx);
+                if (queued.empty())
+                {
+                    running_lanes--;
+                    return;
+                }
+                job = queued.front();
+                queued.pop_front();
+                job->state = "running";
+                job->start_time = wall_seconds();
+            }
+
+            size_t alignments = 0;
+            string error;
+            try
+            {
+                alignments = align_sample(context, job->options, job->files, pool, quiet, false);
+            }
+            catch (const exception &e)
+            {
+                error = e.what();
+            }
+
+            lock_guard<mutex> lock(mtx);
+            job->alignments = alignments;
+            job->error = error;
+            job->state = error.empty() ? "done" : "failed";
+            job->end_time = wall_seconds();
+        }
+    }
+
+    static string describe(const Job &job)
+    {
+        double seconds = job.start_time == 0 ? 0 : (job.end_time == 0 ? wall_seconds() : job.end_time) - job.start_time;
+        char elapsed[32];
+        snprintf(elapsed, sizeof(elapsed), "%.3f", seconds);
+        string line = to_string(job.id) + "\t" + job.state + "\t" + job.files.reads_file + "\t" + (job.files.output_file.empty() ? job.files.genotype_file : job.files.output_file) + "\t" + to_string(job.alignments) + "\t" + elapsed;
+        if (!job.error.empty())
+            line += "\t" + job.error;
+        return line + "\n";
+    }
+};
+
+/* Send one request to a server and print its reply */
+int send_request(const string &socket_path, const string &request)
+{
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client < 0)
+        throw runtime_error("[x] Failed to create socket");
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    expect(socket_path.size() < sizeof(address.sun_path), "[x] Socket path too long: " + socket_path);
+    strcpy(address.sun_path, socket_path.c_str());
+    if (connect(client, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        cerr << "[x] Failed to connect to " << socket_path << endl;
+        close(client);
+        return 1;
+    }
+    string line = request + "\n";
+    expect(write(client, line.data(), line.size()) == (ssize_t)line.size(), "[x] Failed to send request");
+    char buffer[4096];
+    ssize_t n;
+    string reply;
+    while ((n = read(client, buffer, sizeof(buffer))) > 0)
+        reply.append(buffer, n);
+    close(client);
+    cout << reply;
+    return reply.compare(0, 5, "error") == 0;
+}
+
+#endif
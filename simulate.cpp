@@ -0,0 +1,134 @@
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "helper.hpp"
+#include "kir.hpp"
+
+using namespace std;
+
+/* Benchmark helper: simulates paired reads from known alleles and scores alignments against them
+ *
+ *   simulate reads <database> <reads_out> <truth_out> [--depth <x>] [--length <bp>] [--error <rate>] [--alleles <per_gene>] [--seed <n>]
+ *   simulate evaluate <truth> <alignments.tsv>
+ */
+
+int simulate_reads(int argc, char const *argv[]) {
+    string kirs_file = argv[2];
+    string reads_file = argv[3];
+    string truth_file = argv[4];
+    double depth = 30;
+    int read_len = 150;
+    double error_rate = 0.001;
+    int alleles_per_gene = 2;
+    unsigned seed = 1;
+    for (int i = 5; i < argc; i++)
+        if (string(argv[i]) == "--depth")
+            depth = stod(argv[++i]);
+        else if (string(argv[i]) == "--length")
+            read_len = stoi(argv[++i]);
+        else if (string(argv[i]) == "--error")
+            error_rate = stod(argv[++i]);
+        else if (string(argv[i]) == "--alleles")
+            alleles_per_gene = stoi(argv[++i]);
+        else if (string(argv[i]) == "--seed")
+            seed = stoul(argv[++i]);
+
+    unordered_map<string, unordered_map<string, string>> kirs = load_kirs(kirs_file);
+    AlleleDict dict(kirs);
+    mt19937_64 rng(seed);
+    FILE *reads_out = expect(fopen(reads_file.c_str(), "w"), "[-] Error: Unable to open file " + reads_file + " for writing.");
+    FILE *truth_out = expect(fopen(truth_file.c_str(), "w"), "[-] Error: Unable to open file " + truth_file + " for writing.");
+
+    // Fragments of about twice the read length plus a gap, read 1 from the start forward and read 2 from the end reversed
+    normal_distribution<double> fragment_len(2 * read_len + 100, 30);
+    uniform_real_distribution<double> unit(0, 1);
+    auto add_errors = [&](string read) {
+        for (char &base : read)
+            if (unit(rng) < error_rate)
+                base = "ACGT"[(string("ACGT").find(base) + 1 + rng() % 3) % 4];
+        return read;
+    };
+
+    int n_pairs = 0;
+    for (const auto &gene : dict.genes) {
+        IndexSequences alleles = gene_sequences(dict, gene, kirs[gene]);
+        for (int a = 0; a < alleles_per_gene; a++) {
+            size_t i = rng() % alleles.size();
+            const string &allele = alleles.seqs[i];
+            if ((int)allele.size() < read_len)
+                continue;
+            int pairs = depth * allele.size() / (2 * read_len);
+            for (int p = 0; p < pairs; p++) {
+                int len = min(max((int)fragment_len(rng), read_len), (int)allele.size());
+                int start = rng() % (allele.size() - len + 1);
+                string fragment = allele.substr(start, len);
+                string read1 = add_errors(fragment.substr(0, read_len));
+                string read2 = add_errors(ReadStore::reverse_complement(fragment.substr(len - read_len)));
+                fprintf(reads_out, ">r_%d/1 %s:%d\n%s\n>r_%d/2 %s:%d\n%s\n", n_pairs, alleles.names[i].c_str(), start, read1.c_str(),
+                        n_pairs, alleles.names[i].c_str(), start + len - read_len, read2.c_str());
+                // Reads are numbered in file order by the aligner
+                fprintf(truth_out, "%d\t%s\t%s\n%d\t%s\t%s\n", 2 * n_pairs, gene.c_str(), dict.alleles[alleles.allele_ids[i]].c_str(),
+                        2 * n_pairs + 1, gene.c_str(), dict.alleles[alleles.allele_ids[i]].c_str());
+                n_pairs++;
+            }
+        }
+    }
+    fclose(reads_out);
+    fclose(truth_out);
+    cout << "[+] Simulated " << 2 * n_pairs << " reads." << endl;
+    return 0;
+}
+
+/* A read counts as recalled when its true allele is among its lowest-cost hits, and as a false call when it has hits
+ * but its true allele is not among the lowest-cost ones. Ties with alleles identical to the true one still count as
+ * recalled, so recall is not penalized by alleles that no aligner could tell apart. */
+int evaluate(char const *argv[]) {
+    unordered_map<int, string> truth;
+    FILE *truth_in = expect(fopen(argv[2], "r"), string("[x] Failed to open ") + argv[2]);
+    char gene[256], allele[256];
+    int read_id;
+    while (fscanf(truth_in, "%d\t%255s\t%255s", &read_id, gene, allele) == 3)
+        truth[read_id] = string(gene) + "." + allele;
+    fclose(truth_in);
+
+    unordered_map<int, pair<int, unordered_set<string>>> best; // lowest cost and its alleles, by read
+    FILE *alignments_in = expect(fopen(argv[3], "r"), string("[x] Failed to open ") + argv[3]);
+    char line[1 << 16];
+    while (fgets(line, sizeof(line), alignments_in)) {
+        int reversed, cost;
+        if (sscanf(line, "%d\t%255s\t%255s\t%d\t%d", &read_id, gene, allele, &reversed, &cost) != 5)
+            continue;
+        auto it = best.find(read_id);
+        if (it == best.end() || cost < it->second.first)
+            best[read_id] = {cost, {string(gene) + "." + allele}};
+        else if (cost == it->second.first)
+            it->second.second.insert(string(gene) + "." + allele);
+    }
+    fclose(alignments_in);
+
+    size_t recalled = 0, called = 0;
+    for (const auto &read : best) {
+        if (!truth.count(read.first))
+            continue;
+        called++;
+        recalled += read.second.second.count(truth[read.first]);
+    }
+    printf("reads\t%zu\nrecall\t%.4f\nprecision\t%.4f\n", truth.size(), truth.empty() ? 0.0 : (double)recalled / truth.size(), called ? (double)recalled / called : 0.0);
+    return 0;
+}
+
+int main(int argc, char const *argv[]) {
+    string command = argc > 1 ? argv[1] : "";
+    if (command == "reads" && argc >= 5)
+        return simulate_reads(argc, argv);
+    if (command == "evaluate" && argc >= 4)
+        return evaluate(argv);
+    cerr << "Usage: " << argv[0] << " reads <database> <reads_out> <truth_out> [--depth <x>] [--length <bp>] [--error <rate>] [--alleles <per_gene>] [--seed <n>]" << endl;
+    cerr << "       " << argv[0] << " evaluate <truth> <alignments.tsv>" << endl;
+    return 1;
+}
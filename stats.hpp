@@ -0,0 +1,176 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+
+#include "helper.hpp"
+
+using namespace std;
+
+/* Seconds of wall time, or of CPU time of the process or of the calling thread */
+double wall_seconds()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double cpu_seconds(bool whole_process)
+{
+    timespec ts;
+    clock_gettime(whole_process ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Per-stage timings and counters of a run, written as JSON with `--stats`
+ * Top-level stages report the CPU time of the whole process. Gene and region stages run concurrently, so they report
+ * the CPU time of the thread that ran them, which includes the subtasks it ran while waiting on its own.
+ * A long-running process sets aggregate_stages, so that stages of the same name are summed into one entry with their
+ * count, rather than kept one by one for every job. */
+class Stats
+{
+public:
+    atomic<uint64_t> reads_filtered{0}; // reads dropped by the prefilter before mapping
+    atomic<uint64_t> reads_mapped{0};   // reads given to mm_map, duplicates mapped once count once
+    atomic<uint64_t> pairs_mapped{0};   // pairs mapped together as one fragment, their reads also count in reads_mapped
+    atomic<uint64_t> hits_kept{0};      // minimap2 hits within the mismatch limit
+    atomic<uint64_t> hits_rejected{0};  // minimap2 hits over the mismatch limit
+    atomic<uint64_t> hits_improper{0};  // hits of a pair within the mismatch limit, dropped as the mates don't pair there
+    atomic<uint64_t> index_ns{0};       // time spent building or loading indexes, summed over threads
+    atomic<uint64_t> map_ns{0};         // time spent mapping reads, summed over threads
+    atomic<uint64_t> bytes_written{0};
+    double start_time = wall_seconds();
+    bool aggregate_stages = false;
+
+    void add_stage(const string &name, const string &detail, double wall, double cpu)
+    {
+        lock_guard<mutex> lock(mtx);
+        if (!aggregate_stages)
+        {
+            stages.push_back({name, detail, wall, cpu, 1});
+            return;
+        }
+        auto found = stage_ids.emplace(name, stages.size());
+        if (found.second)
+            stages.push_back({name, "", 0, 0, 0});
+        Stage &stage = stages[found.first->second];
+        stage.wall += wall;
+        stage.cpu += cpu;
+        stage.count++;
+    }
+
+    string json()
+    {
+        lock_guard<mutex> lock(mtx);
+        string out;
+        char buffer[512];
+        snprintf(buffer, sizeof(buffer), "{\n  \"wall_s\": %.6f,\n  \"cpu_s\": %.6f,\n  \"stages\": [", wall_seconds() - start_time, cpu_seconds(true));
+        out += buffer;
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            out += i ? ",\n    " : "\n    ";
+            out += "{\"name\": \"" + escape(stages[i].name) + "\", \"detail\": \"" + escape(stages[i].detail) + "\", ";
+            snprintf(buffer, sizeof(buffer), "\"wall_s\": %.6f, \"cpu_s\": %.6f", stages[i].wall, stages[i].cpu);
+            out += buffer;
+            out += aggregate_stages ? ", \"count\": " + to_string(stages[i].count) + "}" : "}";
+        }
+        snprintf(buffer, sizeof(buffer),
+                 "\n  ],\n  \"counters\": {\n"
+                 "    \"reads_filtered\": %llu,\n"
+                 "    \"reads_mapped\": %llu,\n"
+                 "    \"pairs_mapped\": %llu,\n"
+                 "    \"hits_kept\": %llu,\n"
+                 "    \"hits_rejected\": %llu,\n"
+                 "    \"hits_improper\": %llu,\n"
+                 "    \"bytes_written\": %llu,\n"
+                 "    \"index_s\": %.6f,\n"
+                 "    \"map_s\": %.6f\n  }\n}\n",
+                 (unsigned long long)reads_filtered, (unsigned long long)reads_mapped, (unsigned long long)pairs_mapped, (unsigned long long)hits_kept,
+                 (unsigned long long)hits_rejected, (unsigned long long)hits_improper,
+                 (unsigned long long)bytes_written, index_ns * 1e-9, map_ns * 1e-9);
+        out += buffer;
+        return out;
+    }
+
+    void save(const string &stats_file)
+    {
+        FILE *out = expect(fopen(stats_file.c_str(), "w"), "[-] Error: Unable to open file " + stats_file + " for writing.");
+        string report = json();
+        expect(fwrite(report.data(), 1, report.size(), out) == report.size(), "[-] Error: Failed to write " + stats_file);
+        fclose(out);
+    }
+
+private:
+    struct Stage
+    {
+        string name;
+        string detail;
+        double wall;
+        double cpu;
+        size_t count; // stages summed into this one
+    };
+
+    mutex mtx;
+    vector<Stage> stages;
+    unordered_map<string, size_t> stage_ids; // index in stages of each name, when aggregating
+
+    static string escape(const string &value)
+    {
+        string escaped;
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+};
+
+Stats stats;
+
+/* Adds a stage to the stats when it goes out of scope */
+class StageTimer
+{
+public:
+    StageTimer(const string &name, const string &detail = "", bool whole_process = true)
+        : name(name), detail(detail), whole_process(whole_process), wall_start(wall_seconds()), cpu_start(cpu_seconds(whole_process)) {}
+
+    ~StageTimer() { stats.add_stage(name, detail, wall_seconds() - wall_start, cpu_seconds(whole_process) - cpu_start); }
+
+private:
+    string name;
+    string detail;
+    bool whole_process;
+    double wall_start;
+    double cpu_start;
+};
+
+/* Run f as a named stage and return its result */
+template <typename F>
+auto timed(const string &name, F f, const string &detail = "")
+{
+    StageTimer timer(name, detail);
+    return f();
+}
+
+/* Adds the nanoseconds elapsed in its scope to a counter */
+class ScopedNanos
+{
+public:
+    explicit ScopedNanos(atomic<uint64_t> &counter) : counter(counter), start(chrono::steady_clock::now()) {}
+
+    ~ScopedNanos() { counter += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(); }
+
+private:
+    atomic<uint64_t> &counter;
+    chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/* Tasks submitted together, to wait on as a whole
+ * The first exception thrown by a task is kept and rethrown by wait() once every task of the group is done */
+struct TaskGroup
+{
+    atomic<int> pending{0}; // tasks not done
+    atomic<int> queued{0};  // tasks not started, which a thread waiting on the group may run itself
+    mutex mtx;
+    condition_variable cv; // signalled when a task is queued and when the last one is done
+    exception_ptr error;
+};
+
+/* Work-stealing thread pool
+ * Each worker pops tasks from the back of its own queue and steals from the front of the others' when it runs dry.
+ * A thread waiting on a task group runs the group's queued tasks meanwhile, so tasks can submit and wait on subtasks
+ * without blocking a worker, and the pool plus the waiting thread never use more than the thread budget. It runs no
+ * other tasks, so that a wait is never held up behind unrelated work such as another sample, and sleeps while the
+ * rest of its group runs elsewhere. */
+class ThreadPool
+{
+public:
+    /* n_threads - 1 workers are started, the thread that waits on the pool is the last one */
+    explicit ThreadPool(int n_threads) : queues(max(n_threads, 1))
+    {
+        for (auto &queue : queues)
+            queue = make_unique<TaskQueue>();
+        for (int i = 1; i < (int)queues.size(); i++)
+            workers.push_back(thread(&ThreadPool::work, this, i));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(idle_mtx);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    int size() const { return queues.size(); }
+
+    /* Index of the calling thread in [0, size()), threads outside the pool share index 0 */
+    int thread_index() const { return worker_id >= 0 && worker_pool == this ? worker_id : 0; }
+
+    void submit(TaskGroup &group, function<void()> task)
+    {
+        group.pending++;
+        group.queued++;
+        auto &queue = *queues[thread_index()];
+        {
+            lock_guard<mutex> lock(queue.mtx);
+            queue.tasks.push_back({&group, [&group, task = move(task)]()
+                                   {
+                                       try
+                                       {
+                                           task();
+                                       }
+                                       catch (...)
+                                       {
+                                           lock_guard<mutex> lock(group.mtx);
+                                           if (!group.error)
+                                               group.error = current_exception();
+                                       }
+                                       // Under the lock, so that the waiter can't return and destroy the group before this is done with it
+                                       lock_guard<mutex> lock(group.mtx);
+                                       if (--group.pending == 0)
+                                           group.cv.notify_all();
+                                   }});
+        }
+        {
+            lock_guard<mutex> lock(idle_mtx); // so that a worker about to sleep can't miss the notification
+            n_queued++;
+        }
+        idle_cv.notify_one();
+        lock_guard<mutex> lock(group.mtx);
+        group.cv.notify_all();
+    }
+
+    /* Run the group's queued tasks until all of them are done, then rethrow the first exception of a task */
+    void wait(TaskGroup &group)
+    {
+        int self = thread_index();
+        unique_lock<mutex> lock(group.mtx);
+        while (group.pending > 0)
+        {
+            lock.unlock();
+            bool ran = run_one(self, &group);
+            lock.lock();
+            if (!ran)
+                group.cv.wait(lock, [&]()
+                              { return group.pending == 0 || group.queued > 0; });
+        }
+        if (group.error)
+            rethrow_exception(exchange(group.error, nullptr));
+    }
+
+    /* Run one queued task of the group on the calling thread, false if there is none */
+    bool help(TaskGroup &group) { return run_one(thread_index(), &group); }
+
+    /* Run f(i) for i in [0, n) on the pool and wait for all of them */
+    void parallel_for(int n, const function<void(int)> &f)
+    {
+        TaskGroup group;
+        for (int i = 0; i < n; i++)
+            submit(group, [&f, i]()
+                   { f(i); });
+        wait(group);
+    }
+
+    /* Run f(i) for i in [0, n) on the calling thread, with idle pool threads helping, and wait for all of them
+     * Unlike parallel_for, the caller runs none of the pool's other tasks, so a thread outside the pool that must not pick
+     * up alignment tasks, like the output writer or the reads parser, still shares the pool's thread budget. Helpers
+     * that only start once all of f is done find nothing left and return at once. */
+    void run_shared(int n, const function<void(int)> &f)
+    {
+        struct SharedRun
+        {
+            int n;
+            function<void(int)> f;
+            atomic<int> next{0};
+            atomic<int> done{0};
+            mutex mtx;
+            condition_variable cv;
+            exception_ptr error;
+            TaskGroup group;
+        };
+        auto shared = make_shared<SharedRun>();
+        shared->n = n;
+        shared->f = f;
+        auto run = [shared]()
+        {
+            for (int i; (i = shared->next++) < shared->n;)
+            {
+                try
+                {
+                    shared->f(i);
+                }
+                catch (...)
+                {
+                    lock_guard<mutex> lock(shared->mtx);
+                    if (!shared->error)
+                        shared->error = current_exception();
+                }
+                if (++shared->done == shared->n)
+                {
+                    lock_guard<mutex> lock(shared->mtx);
+                    shared->cv.notify_all();
+                }
+            }
+        };
+        for (int helper = 1; helper < min(n, size()); helper++)
+            submit(shared->group, run);
+        run();
+        unique_lock<mutex> lock(shared->mtx);
+        shared->cv.wait(lock, [&]()
+                        { return shared->done == shared->n; });
+        if (shared->error)
+            rethrow_exception(shared->error);
+    }
+
+private:
+    struct Task
+    {
+        TaskGroup *group;
+        function<void()> run;
+    };
+
+    struct TaskQueue
+    {
+        mutex mtx;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<TaskQueue>> queues; // queue 0 belongs to the threads outside the pool
+    vector<thread> workers;
+    atomic<int> n_queued{0};
+    mutex idle_mtx;
+    condition_variable idle_cv;
+    bool stopping = false;
+
+    static thread_local int worker_id;
+    static thread_local ThreadPool *worker_pool;
+
+    /* Run a queued task, only one of group if given: the newest of the own queue, or else the oldest of another */
+    bool run_one(int self, TaskGroup *group = nullptr)
+    {
+        if (group && group->queued == 0)
+            return false;
+        Task task{nullptr, nullptr};
+        {
+            auto &own = *queues[self];
+            lock_guard<mutex> lock(own.mtx);
+            for (auto it = own.tasks.rbegin(); it != own.tasks.rend(); ++it)
+                if (!group || it->group == group)
+                {
+                    task = move(*it);
+                    own.tasks.erase(next(it).base());
+                    break;
+                }
+        }
+        for (int i = 1; !task.run && i < (int)queues.size(); i++)
+        {
+            auto &victim = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(victim.mtx);
+            for (auto it = victim.tasks.begin(); it != victim.tasks.end(); ++it)
+                if (!group || it->group == group)
+                {
+                    task = move(*it);
+                    victim.tasks.erase(it);
+                    break;
+                }
+        }
+        if (!task.run)
+            return false;
+        task.group->queued--;
+        n_queued--;
+        task.run();
+        return true;
+    }
+
+    void work(int id)
+    {
+        worker_id = id;
+        worker_pool = this;
+        while (true)
+        {
+            if (run_one(id))
+                continue;
+            unique_lock<mutex> lock(idle_mtx);
+            idle_cv.wait(lock, [this]()
+                         { return stopping || n_queued > 0; });
+            if (stopping && n_queued == 0)
+                return;
+        }
+    }
+};
+
+thread_local int ThreadPool::worker_id = -1;
+thread_local ThreadPool *ThreadPool::worker_pool = nullptr;
+
+#endif
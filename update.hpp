@@ -0,0 +1,170 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <zlib.h>
+
+#include "helper.hpp"
+#include "alignment.hpp"
+#include "binary_format.hpp"
+#include "kir.hpp"
+
+using namespace std;
+
+/* Content hash of each gene of the database, by gene ID */
+vector<uint64_t> gene_hashes(const AlleleDict &dict, const unordered_map<string, unordered_map<string, string>> &kirs)
+{
+    vector<uint64_t> hashes;
+    for (const auto &gene : dict.genes)
+        hashes.push_back(gene_hash(gene_sequences(dict, gene, kirs.at(gene))));
+    return hashes;
+}
+
+/* The database each gene of an alignments file was aligned against, stored next to it as `<alignments_file>.genes`
+ * One line per gene of the database: `<gene>\t<gene hash>\t<number of alignments>` */
+struct GeneManifest
+{
+    map<string, pair<uint64_t, size_t>> genes;
+
+    static string path(const string &alignments_file) { return alignments_file + ".genes"; }
+
+    void save(const string &alignments_file) const
+    {
+        FILE *out = expect(fopen(path(alignments_file).c_str(), "w"), "[-] Error: Unable to open file " + path(alignments_file) + " for writing.");
+        for (const auto &gene : genes)
+            fprintf(out, "%s\t%016llx\t%zu\n", gene.first.c_str(), (unsigned long long)gene.second.first, gene.second.second);
+        fclose(out);
+    }
+
+    static GeneManifest load(const string &alignments_file)
+    {
+        ifstream in(path(alignments_file));
+        expect(in.good(), "[x] No gene hashes for " + alignments_file + ", it can only be updated if written with this version");
+        GeneManifest manifest;
+        string gene, hash;
+        size_t n_alignments;
+        while (in >> gene >> hash >> n_alignments)
+            manifest.genes[gene] = {stoull(hash, nullptr, 16), n_alignments};
+        return manifest;
+    }
+};
+
+/* Alignments of a previous run, read back one gene at a time to be spliced into a new output
+ * Text (optionally gzipped) and `.kab` files are read, and alleles are mapped to the current database by name */
+class PreviousAlignments
+{
+public:
+    /* The file is checked up front, so that a missing or unreadable file fails before any alignment starts */
+    PreviousAlignments(const string &alignments_file, const AlleleDict &dict) : alignments_file(alignments_file), dict(dict)
+    {
+        if (BinaryAlignmentReader::is_binary(alignments_file))
+            BinaryAlignmentReader reader(alignments_file);
+        else
+            gzclose(expect(gzopen(alignments_file.c_str(), "r"), "[x] Failed to open alignments file " + alignments_file));
+    }
+
+    /* Call f(gene_id, alignments) for each gene of the file whose keep flag is set, in file order */
+    void for_each_gene(const vector<char> &keep, const function<void(int, AlignmentSet &&)> &f)
+    {
+        int current_gene = -1;
+        AlignmentSet alignments;
+        auto add = [&](int allele_id, AlignmentRecord record, const uint32_t *cigar, uint32_t n_cigar)
+        {
+            int gene_id = dict.allele_gene[allele_id];
+            if (gene_id != current_gene && current_gene != -1)
+                f(current_gene, move(alignments));
+            if (gene_id != current_gene)
+                alignments = AlignmentSet();
+            current_gene = gene_id;
+            record.allele_id = allele_id;
+            alignments.add(record, cigar, n_cigar);
+        };
+
+        if (BinaryAlignmentReader::is_binary(alignments_file))
+        {
+            BinaryAlignmentReader reader(alignments_file);
+            vector<int> allele_ids = map_alleles(reader.dict, keep);
+            for (uint32_t b = 0; b < reader.blocks.size(); b++)
+            {
+                AlignmentSet block = reader.read_block(b);
+                for (const auto &record : block.records)
+                    if (allele_ids[record.allele_id] != -1)
+                        add(allele_ids[record.allele_id], record, block.cigars.data() + record.cigar_offset, record.n_cigar);
+            }
+        }
+        else
+        {
+            gzFile in = expect(gzopen(alignments_file.c_str(), "r"), "[x] Failed to open alignments file " + alignments_file);
+            string line;
+            vector<uint32_t> cigar;
+            char buffer[1 << 16];
+            while (gzgets(in, buffer, sizeof(buffer)))
+            {
+                line += buffer;
+                if (line.back() != '\n' && !gzeof(in))
+                    continue; // longer than the buffer
+                while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+                    line.pop_back();
+                vector<string_view> fields = split_fields(line);
+                if (fields.size() >= 10)
+                {
+                    auto it = dict.allele_ids.find(string(fields[1]) + "." + string(fields[2]));
+                    if (it != dict.allele_ids.end() && keep[dict.allele_gene[it->second]])
+                    {
+                        AlignmentRecord record = {parse_int(fields[0]), it->second, parse_int(fields[4]), parse_int(fields[5]), parse_int(fields[6]),
+                                                  parse_int(fields[7]), parse_int(fields[8]), 0, 0, fields[3] == "1"};
+                        parse_cigar(fields[9], cigar);
+                        add(it->second, record, cigar.data(), cigar.size());
+                    }
+                }
+                line.clear();
+            }
+            gzclose(in);
+        }
+        if (current_gene != -1)
+            f(current_gene, move(alignments));
+    }
+
+private:
+    string alignments_file;
+    const AlleleDict &dict;
+
+    /* Allele ID in the current database of each allele of a binary file's dictionary, -1 if not kept */
+    vector<int> map_alleles(const AlleleDict &file_dict, const vector<char> &keep)
+    {
+        vector<int> allele_ids(file_dict.alleles.size(), -1);
+        for (size_t i = 0; i < file_dict.alleles.size(); i++)
+        {
+            auto it = dict.allele_ids.find(file_dict.name(i));
+            if (it != dict.allele_ids.end() && keep[dict.allele_gene[it->second]])
+                allele_ids[i] = it->second;
+        }
+        return allele_ids;
+    }
+
+    static void parse_cigar(string_view text, vector<uint32_t> &cigar)
+    {
+        cigar.clear();
+        uint32_t length = 0;
+        for (char c : text)
+            if (c >= '0' && c <= '9')
+                length = length * 10 + (c - '0');
+            else
+            {
+                const char *op = strchr(MM_CIGAR_STR, c);
+                expect(op && c, "[x] Invalid CIGAR " + string(text));
+                cigar.push_back(length << 4 | (op - MM_CIGAR_STR));
+                length = 0;
+            }
+    }
+};
+
+#endif
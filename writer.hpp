@@ -0,0 +1,329 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <charconv>
+#include <exception>
+#include <cstdio>
+#include <zlib.h>
+
+#include "helper.hpp"
+#include "alignment.hpp"
+#include "binary_format.hpp"
+#include "read_store.hpp"
+#include "sam_format.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+
+/* Writes the alignments of each gene as soon as the gene is done, on its own thread, while the other genes are still
+ * being aligned. Genes are written in gene ID order, so the file is the same as writing the sorted results at the end.
+ * Output files ending in `.gz` are written as concatenated gzip members, compressed in parallel blocks on the pool,
+ * and output files ending in `.kab` in the indexed binary format of binary_format.hpp. Files ending in `.paf`, `.sam`
+ * or `.bam` are written in those formats by AlignmentFormatter, BAM in BGZF blocks compressed on the pool the same way.
+ * Genes finished ahead of the one being written wait in memory, so whoever hands them over checks has_room() first and
+ * keeps them within MAX_GENES_AHEAD of it. */
+class AlignmentWriter
+{
+public:
+    static const size_t BLOCK_SIZE = 4 << 20;     // bytes of text per write or gzip member
+    static const size_t COMPRESS_BLOCKS = 8;      // blocks compressed together, 32 MiB of text
+    static const size_t MAX_GENES_AHEAD = 8;      // genes that may be handed over ahead of the one being written
+
+    size_t records_written = 0;
+    size_t bytes_written = 0;
+
+    /* Only genes in gene_order are expected, an empty output file discards the alignments
+     * PAF, SAM and BAM need the length of each allele, by allele ID, and take the read lengths and sequences from reads */
+    AlignmentWriter(const string &output_file, const AlleleDict &dict, vector<int> gene_order, ThreadPool &pool,
+                    const vector<int> &allele_lengths = {}, const ReadStore *reads = nullptr)
+        : dict(dict), gene_order(move(gene_order)), pool(pool), output_file(output_file), positions(dict.genes.size(), 0)
+    {
+        for (size_t i = 0; i < this->gene_order.size(); i++)
+            positions[this->gene_order[i]] = i;
+        if (!output_file.empty())
+        {
+            out_file = expect(fopen(output_file.c_str(), "wb"), "[-] Error: Unable to open file " + output_file + " for writing.");
+            OutputFormat format = output_format(output_file);
+            bgzf = format == OutputFormat::BAM;
+            compress = ends_with(output_file, ".gz") && !bgzf;
+            if (format == OutputFormat::KAB)
+                binary = make_unique<BinaryAlignmentWriter>(out_file, output_file + ".idx", dict);
+            else if (AlignmentFormatter::needs_reads(format))
+                formatter = make_unique<AlignmentFormatter>(format, dict, allele_lengths, reads);
+        }
+        writer = thread(&AlignmentWriter::run, this);
+    }
+
+    /* A writer not finished, e.g. when unwinding from a failure, is aborted rather than left waiting for its genes */
+    ~AlignmentWriter()
+    {
+        if (writer.joinable())
+            abort();
+    }
+
+    /* Hand over the sorted alignments of a finished gene, may be called from any thread */
+    void add(int gene_id, AlignmentSet &&alignments)
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            finished[gene_id] = move(alignments);
+        }
+        cv.notify_one();
+    }
+
+    /* Whether a gene may be handed over without running too far ahead of the writer, always true once it stopped */
+    bool has_room(int gene_id)
+    {
+        lock_guard<mutex> lock(mtx);
+        return room_for(gene_id);
+    }
+
+    /* Wait until has_room(gene_id) */
+    void wait_for_room(int gene_id)
+    {
+        unique_lock<mutex> lock(mtx);
+        room.wait(lock, [&]()
+                  { return room_for(gene_id); });
+    }
+
+    /* Wait for every expected gene to be written and close the file, rethrows a failure to write */
+    void finish()
+    {
+        writer.join();
+        if (out_file)
+            fclose(out_file);
+        out_file = nullptr;
+        if (error)
+            rethrow_exception(error);
+    }
+
+    /* Stop waiting for genes, e.g. once a gene failed, from any thread. Nothing more is written. */
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            aborted = true;
+        }
+        cv.notify_one();
+        room.notify_all();
+    }
+
+    /* Stop without waiting for the genes still expected, and delete the incomplete output */
+    void abort()
+    {
+        stop();
+        if (writer.joinable())
+            writer.join();
+        if (out_file)
+        {
+            fclose(out_file);
+            remove(output_file.c_str());
+            remove((output_file + ".idx").c_str());
+        }
+        out_file = nullptr;
+    }
+
+private:
+    const AlleleDict &dict;
+    vector<int> gene_order;
+    ThreadPool &pool;
+    string output_file;
+    FILE *out_file = nullptr;
+    bool compress = false;
+    bool bgzf = false;
+    unique_ptr<BinaryAlignmentWriter> binary;
+    unique_ptr<AlignmentFormatter> formatter;
+    thread writer;
+
+    mutex mtx;
+    condition_variable cv;   // signalled when a gene is handed over
+    condition_variable room; // signalled when a gene is written
+    map<int, AlignmentSet> finished; // genes done but not written yet
+    vector<size_t> positions;        // of each gene in gene_order
+    size_t n_written = 0;            // genes of gene_order written
+    bool done = false;               // the writer thread is done, successfully or not
+    bool aborted = false;
+    exception_ptr error; // failure of the writer thread, rethrown by finish()
+
+    vector<string> blocks; // formatted blocks waiting to be written, the last one is being filled
+
+    void run()
+    {
+        try
+        {
+            write_all();
+        }
+        catch (...)
+        {
+            error = current_exception();
+        }
+        {
+            lock_guard<mutex> lock(mtx);
+            done = true;
+        }
+        room.notify_all();
+    }
+
+    bool room_for(int gene_id) const { return done || aborted || positions[gene_id] < n_written + MAX_GENES_AHEAD; }
+
+    void write_all()
+    {
+        blocks.emplace_back();
+        blocks.back().reserve(BLOCK_SIZE + 4096);
+        if (formatter)
+            blocks.back() = formatter->header();
+        for (int gene_id : gene_order)
+        {
+            AlignmentSet alignments;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [&]()
+                        { return finished.count(gene_id) || aborted; });
+                if (aborted)
+                    return;
+                alignments = move(finished[gene_id]);
+                finished.erase(gene_id);
+            }
+            if (binary)
+            {
+                binary->write(alignments);
+                records_written += alignments.size();
+            }
+            else if (out_file)
+                write_gene(alignments);
+            {
+                lock_guard<mutex> lock(mtx);
+                n_written++;
+            }
+            room.notify_all();
+        }
+        if (binary)
+        {
+            binary->finish();
+            bytes_written = binary->bytes_written;
+        }
+        else
+            flush_blocks(true);
+        if (bgzf && out_file)
+        {
+            expect(fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), out_file) == sizeof(BGZF_EOF), "[-] Error: Failed to write alignments.");
+            bytes_written += sizeof(BGZF_EOF);
+        }
+    }
+
+    void write_gene(const AlignmentSet &alignments)
+    {
+        for (const auto &alignment : alignments.records)
+        {
+            string &block = blocks.back();
+            if (formatter)
+                formatter->append(block, alignment, alignments);
+            else
+                append_tsv(block, alignment, alignments);
+            records_written++;
+
+            if (block.size() >= BLOCK_SIZE)
+            {
+                flush_blocks(false);
+                blocks.emplace_back();
+                blocks.back().reserve(BLOCK_SIZE + 4096);
+            }
+        }
+    }
+
+    void append_tsv(string &block, const AlignmentRecord &alignment, const AlignmentSet &alignments)
+    {
+        char number[16];
+        auto append_number = [&](string &block, int value)
+        {
+            auto end = to_chars(number, number + sizeof(number), value).ptr;
+            block.append(number, end);
+        };
+
+        append_number(block, alignment.read_id);
+        block += '\t';
+        block += dict.gene(alignment.allele_id);
+        block += '\t';
+        block += dict.alleles[alignment.allele_id];
+        block += alignment.reversed ? "\t1\t" : "\t0\t";
+        append_number(block, alignment.cost);
+        block += '\t';
+        append_number(block, alignment.read_start);
+        block += '\t';
+        append_number(block, alignment.read_end);
+        block += '\t';
+        append_number(block, alignment.query_start);
+        block += '\t';
+        append_number(block, alignment.query_end);
+        block += '\t';
+        for (uint32_t k = alignment.cigar_offset; k < alignment.cigar_offset + alignment.n_cigar; k++)
+        {
+            append_number(block, alignments.cigars[k] >> 4);
+            block += MM_CIGAR_STR[alignments.cigars[k] & 0xf];
+        }
+        block += '\n';
+    }
+
+    /* Write out the full blocks, gzip and BGZF blocks are compressed COMPRESS_BLOCKS at a time, on the pool */
+    void flush_blocks(bool last)
+    {
+        if (last && !blocks.empty() && blocks.back().empty())
+            blocks.pop_back();
+        if (!out_file || ((compress || bgzf) && !last && blocks.size() < COMPRESS_BLOCKS))
+            return;
+
+        if (bgzf)
+        {
+            // Every 64 KiB BGZF block is its own item, so that even one flushed block spreads over the pool
+            vector<pair<size_t, size_t>> pieces; // (block, offset in it)
+            for (size_t i = 0; i < blocks.size(); i++)
+                for (size_t offset = 0; offset < blocks[i].size(); offset += BGZF_BLOCK_SIZE)
+                    pieces.push_back({i, offset});
+            vector<string> members(pieces.size());
+            pool.run_shared(pieces.size(), [&](int p)
+                            {
+                                const string &block = blocks[pieces[p].first];
+                                size_t offset = pieces[p].second;
+                                members[p] = bgzf_block(block.data() + offset, min(BGZF_BLOCK_SIZE, block.size() - offset));
+                            });
+            blocks.swap(members);
+        }
+        else if (compress)
+        {
+            vector<string> members(blocks.size());
+            pool.run_shared(blocks.size(), [&](int i)
+                            { members[i] = gzip_block(blocks[i]); });
+            blocks.swap(members);
+        }
+        for (const auto &block : blocks)
+        {
+            expect(fwrite(block.data(), 1, block.size(), out_file) == block.size(), "[-] Error: Failed to write alignments.");
+            bytes_written += block.size();
+        }
+        blocks.clear();
+    }
+
+    static string gzip_block(const string &block)
+    {
+        z_stream zs = {};
+        expect(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK, "Failed to initialize gzip compression");
+        string member(deflateBound(&zs, block.size()), '\0');
+        zs.next_in = (Bytef *)block.data();
+        zs.avail_in = block.size();
+        zs.next_out = (Bytef *)&member[0];
+        zs.avail_out = member.size();
+        expect(deflate(&zs, Z_FINISH) == Z_STREAM_END, "Failed to compress alignments");
+        member.resize(zs.total_out);
+        deflateEnd(&zs);
+        return member;
+    }
+};
+
+#endif